@@ -32,10 +32,23 @@
 
 struct my_surface {
 	struct surface base;
-	EGLSurface egl_surface;
-	GLuint fbo[2];
-	GLuint tex[2];
+	/* rendered with GL, not so on the fake device */
+	bool gl;
+	/* YUV frames written by the CPU, see video_fill() */
+	bool video;
+	/*
+	 * Each swapchain buffer, imported and bound to a framebuffer.
+	 * A YUV buffer gets one for each of its planes.
+	 */
+	EGLImageKHR image[SURFACE_MAX_DEPTH][FORMAT_MAX_PLANES];
+	GLuint rb[SURFACE_MAX_DEPTH][FORMAT_MAX_PLANES];
+	GLuint fb[SURFACE_MAX_DEPTH][FORMAT_MAX_PLANES];
+	/* the last one holds a YUV surface's frame before conversion */
+	GLuint fbo[3];
+	GLuint tex[3];
 	GLfloat rot, phase;
+	uint64_t anim_time; /* when rot and phase were last advanced, in ns */
+	int fence_fd; /* rendering of the last frame, -1 if none */
 };
 
 #endif
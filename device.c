@@ -0,0 +1,158 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+#include "device.h"
+
+#define MAX_DEVICES 16
+
+static const char *node_type_str[] = {
+	[DRM_NODE_PRIMARY] = "primary",
+	[DRM_NODE_CONTROL] = "control",
+	[DRM_NODE_RENDER]  = "render",
+};
+
+static bool has_kms(int fd)
+{
+	drmModeResPtr res;
+	bool ret;
+
+	res = drmModeGetResources(fd);
+	ret = res && res->count_crtcs > 0 && res->count_connectors > 0;
+	drmModeFreeResources(res);
+
+	return ret;
+}
+
+static bool driver_is(int fd, const char *name)
+{
+	drmVersionPtr ver;
+	bool ret;
+
+	ver = drmGetVersion(fd);
+	ret = ver && !strcmp(ver->name, name);
+	drmFreeVersion(ver);
+
+	return ret;
+}
+
+int open_device(const char *name, int type)
+{
+	drmDevicePtr devices[MAX_DEVICES];
+	int count, i;
+	int fd = -1;
+
+	if (name && name[0] == '/')
+		return open(name, O_RDWR | O_CLOEXEC);
+
+	count = drmGetDevices2(0, devices, MAX_DEVICES);
+	if (count < 0) {
+		errno = -count;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		int t = type;
+		bool match;
+
+		/* the primary node can render too, if there's no render node */
+		if (!(devices[i]->available_nodes & (1 << t)))
+			t = DRM_NODE_PRIMARY;
+		if (!(devices[i]->available_nodes & (1 << t)))
+			continue;
+
+		fd = open(devices[i]->nodes[t], O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		if (name)
+			match = driver_is(fd, name);
+		else
+			match = type == DRM_NODE_RENDER || has_kms(fd);
+
+		if (match) {
+			printf("using %s for %s\n", devices[i]->nodes[t],
+			       type == DRM_NODE_RENDER ? "rendering" : "scanout");
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	drmFreeDevices(devices, count);
+
+	if (fd < 0)
+		errno = ENODEV;
+
+	return fd;
+}
+
+void list_devices(void)
+{
+	drmDevicePtr devices[MAX_DEVICES];
+	int count, i, j;
+
+	count = drmGetDevices2(0, devices, MAX_DEVICES);
+	if (count < 0) {
+		printf("no DRM devices: %s\n", strerror(-count));
+		return;
+	}
+
+	for (i = 0; i < count; i++) {
+		int fd = -1;
+
+		printf("device %d:\n", i);
+
+		for (j = 0; j < DRM_NODE_MAX; j++) {
+			if (!(devices[i]->available_nodes & (1 << j)))
+				continue;
+
+			printf("\t%-8s %s\n", node_type_str[j], devices[i]->nodes[j]);
+
+			if (fd < 0 && j != DRM_NODE_CONTROL)
+				fd = open(devices[i]->nodes[j], O_RDWR | O_CLOEXEC);
+		}
+
+		if (fd >= 0) {
+			drmVersionPtr ver = drmGetVersion(fd);
+
+			printf("\tdriver   %s%s\n", ver ? ver->name : "?",
+			       (devices[i]->available_nodes & (1 << DRM_NODE_PRIMARY)) &&
+			       has_kms(fd) ? ", can scan out" : "");
+			drmFreeVersion(ver);
+			close(fd);
+		}
+	}
+
+	drmFreeDevices(devices, count);
+}
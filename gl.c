@@ -22,16 +22,34 @@
  */
 
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
+#include <unistd.h>
+#include <gbm.h>
+#include <drm_fourcc.h>
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
 #include <GLES2/gl2.h>
+#include <GLES2/gl2ext.h>
 
 #include "gl.h"
 
+/* radians per second, what a frame used to add at 60Hz */
+#define ROT_SPEED	0.6f
+#define PHASE_SPEED	12.0f
+
 static GLuint normal_program;
 static GLuint ripple_program;
 static GLuint blur_program;
+static GLuint yuv_program;
+
+static PFNEGLCREATESYNCKHRPROC create_sync;
+static PFNEGLDESTROYSYNCKHRPROC destroy_sync;
+static PFNEGLDUPNATIVEFENCEFDANDROIDPROC dup_native_fence_fd;
+
+static PFNEGLCREATEIMAGEKHRPROC create_image;
+static PFNEGLDESTROYIMAGEKHRPROC destroy_image;
+static PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC image_target_renderbuffer_storage;
 
 static GLint create_program(const char *vert_source, const char *frag_source)
 {
@@ -188,6 +206,33 @@ static GLuint create_blur_program(void)
 	return create_program(vert_source, frag_source);
 }
 
+/* RGB to BT.601 limited range, the Y, Cb or Cr of un_plane in .r, .g, .b */
+static GLuint create_yuv_program(void)
+{
+	static const char *vert_source =
+		"attribute vec2 in_position;\n"
+		"varying vec2 texcoord;\n"
+		"\n"
+		"void main()\n"
+		"{\n"
+		"   gl_Position = vec4(in_position, 0.0, 1.0);\n"
+		"   texcoord = in_position * 0.5 + 0.5;\n"
+		"}\n";
+	static const char *frag_source =
+		"uniform sampler2D tex;\n"
+		"uniform mat3 un_coefs;\n"
+		"uniform vec3 un_offsets;\n"
+		"varying vec2 texcoord;\n"
+		"\n"
+		"void main()\n"
+		"{\n"
+		"   vec3 rgb = texture2D(tex, texcoord).rgb;\n"
+		"   gl_FragColor = vec4(un_coefs * rgb + un_offsets, 1.0);\n"
+		"}\n";
+
+	return create_program(vert_source, frag_source);
+}
+
 #define min(a,b) ((a) < (b) ? (a) : (b))
 
 static void render(GLfloat rot)
@@ -327,16 +372,44 @@ static void render_blur(bool vert)
 	glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
 }
 
+/*
+ * Where a frame gets drawn: the back buffer itself, or for YUV
+ * surfaces an RGB texture that gl_surf_resolve() converts from.
+ */
+static GLuint back_fb(struct my_surface *s)
+{
+	struct buffer *b = surface_get_back(&s->base);
+
+	if (!b)
+		return 0;
+	if (format_is_yuv(s->base.info))
+		return s->fbo[2];
+
+	return s->fb[b - s->base.buffers][0];
+}
+
+/* points GL at the back buffer, false if there isn't one to draw to */
+bool gl_surf_bind(struct my_surface *s)
+{
+	GLuint fb = back_fb(s);
+
+	if (!fb)
+		return false;
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fb);
+
+	return true;
+}
+
 void gl_surf_clear(EGLDisplay dpy, EGLContext ctx,
 		   struct my_surface *s,
 		   bool col)
 {
-	if (!eglMakeCurrent(dpy, s->egl_surface, s->egl_surface, ctx))
+	if (!gl_surf_bind(s))
 		return;
 
 	glViewport(0, 0, (GLint) s->base.width, (GLint) s->base.height);
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glBindTexture(GL_TEXTURE_2D, 0);
 	if (col)
 		glClearColor(0.4f, 0.4f, 0.4f, 0.4f);
@@ -345,13 +418,87 @@ void gl_surf_clear(EGLDisplay dpy, EGLContext ctx,
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 }
 
+/*
+ * Fills in each plane of a YUV back buffer from the RGB frame, which
+ * is sampled linearly so the chroma plane gets an average.  A no-op
+ * for RGB surfaces, which were drawn to directly.
+ */
+void gl_surf_resolve(struct my_surface *s)
+{
+	/* per plane, the columns are what R, G and B add to each channel */
+	static const GLfloat coefs[2][9] = {
+		/* Y */
+		{ 0.257f, 0.0f, 0.0f,  0.504f, 0.0f, 0.0f,  0.098f, 0.0f, 0.0f },
+		/* Cb and Cr */
+		{ -0.148f, 0.439f, 0.0f,  -0.291f, -0.368f, 0.0f,  0.439f, -0.071f, 0.0f },
+	};
+	static const GLfloat offsets[2][3] = {
+		{ 0.0625f, 0.0f, 0.0f },
+		{ 0.5f, 0.5f, 0.0f },
+	};
+	static const GLfloat verts[] = {
+		-1.0f, -1.0f,
+		 1.0f, -1.0f,
+		-1.0f,  1.0f,
+		 1.0f,  1.0f,
+	};
+	const struct format_info *info = s->base.info;
+	struct buffer *b = surface_get_back(&s->base);
+	GLint position_attr, coefs_unif, offsets_unif;
+	int i;
+
+	if (!b || !format_is_yuv(info))
+		return;
+
+	glUseProgram(yuv_program);
+	glBindTexture(GL_TEXTURE_2D, s->tex[2]);
+
+	position_attr = glGetAttribLocation(yuv_program, "in_position");
+	coefs_unif = glGetUniformLocation(yuv_program, "un_coefs");
+	offsets_unif = glGetUniformLocation(yuv_program, "un_offsets");
+
+	glVertexAttribPointer(position_attr, 2, GL_FLOAT, GL_FALSE, 0, verts);
+	glEnableVertexAttribArray(position_attr);
+
+	for (i = 0; i < info->count_planes; i++) {
+		glBindFramebuffer(GL_FRAMEBUFFER, s->fb[b - s->base.buffers][i]);
+		glViewport(0, 0, s->base.width / info->planes[i].hsub,
+			   s->base.height / info->planes[i].vsub);
+
+		glUniformMatrix3fv(coefs_unif, 1, GL_FALSE, coefs[i]);
+		glUniform3fv(offsets_unif, 1, offsets[i]);
+
+		glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+	}
+}
+
+/*
+ * How far to move things along, in seconds, given the time the frame is
+ * for.  The speed no longer depends on the frame rate, which with
+ * variable refresh isn't fixed.  Long stalls don't turn into a jump.
+ */
+static float anim_step(struct my_surface *s, uint64_t now)
+{
+	float dt = s->anim_time ? (now - s->anim_time) / 1000000000.0f : 0.0f;
+
+	s->anim_time = now;
+
+	return dt > 0.1f ? 0.1f : dt;
+}
+
 void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 		    struct my_surface *s,
-		    bool col, bool anim, bool blur)
+		    bool col, bool anim, bool blur,
+		    uint64_t now)
 {
-	if (!eglMakeCurrent(dpy, s->egl_surface, s->egl_surface, ctx))
+	GLuint fb = back_fb(s);
+	float dt;
+
+	if (!fb)
 		return;
 
+	dt = anim_step(s, now);
+
 	glViewport(0, 0, (GLint) s->base.width, (GLint) s->base.height);
 
 	glBindFramebuffer(GL_FRAMEBUFFER, s->fbo[0]);
@@ -364,7 +511,7 @@ void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	render(s->rot);
 	if (anim)
-		s->rot += 0.01f;
+		s->rot += ROT_SPEED * dt;
 	if (s->rot > 2.0f * M_PI)
 		s->rot -= 2.0f * M_PI;
 
@@ -372,7 +519,7 @@ void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 		glBindFramebuffer(GL_FRAMEBUFFER, s->fbo[1]);
 		glBindTexture(GL_TEXTURE_2D, s->tex[0]);
 	} else {
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, fb);
 	}
 
 	glBindTexture(GL_TEXTURE_2D, s->tex[0]);
@@ -380,7 +527,7 @@ void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 	render_ripple(s->phase);
-	s->phase += 0.2f;
+	s->phase += PHASE_SPEED * dt;
 	if (s->phase > 2.0f * M_PI)
 		s->phase -= 2.0f * M_PI;
 
@@ -393,7 +540,7 @@ void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		render_blur(false);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, fb);
 		glBindTexture(GL_TEXTURE_2D, s->tex[0]);
 		glUseProgram(blur_program);
 		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
@@ -421,7 +568,7 @@ void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 		render_blur(false);
 
-		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindFramebuffer(GL_FRAMEBUFFER, fb);
 		glBindTexture(GL_TEXTURE_2D, s->tex[0]);
 		glUseProgram(blur_program);
 		glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
@@ -436,6 +583,7 @@ void gl_fini(void)
 	glDeleteProgram(ripple_program);
 	glDeleteProgram(normal_program);
 	glDeleteProgram(blur_program);
+	glDeleteProgram(yuv_program);
 }
 
 bool gl_init(void)
@@ -443,75 +591,302 @@ bool gl_init(void)
 	normal_program = create_normal_program();
 	ripple_program = create_ripple_program();
 	blur_program = create_blur_program();
+	yuv_program = create_yuv_program();
 
-	return normal_program && ripple_program && blur_program;
+	return normal_program && ripple_program && blur_program && yuv_program;
+}
+
+bool gl_fence_init(EGLDisplay dpy)
+{
+	const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+
+	if (!exts || !strstr(exts, "EGL_ANDROID_native_fence_sync"))
+		return false;
+
+	create_sync = (PFNEGLCREATESYNCKHRPROC)
+		eglGetProcAddress("eglCreateSyncKHR");
+	destroy_sync = (PFNEGLDESTROYSYNCKHRPROC)
+		eglGetProcAddress("eglDestroySyncKHR");
+	dup_native_fence_fd = (PFNEGLDUPNATIVEFENCEFDANDROIDPROC)
+		eglGetProcAddress("eglDupNativeFenceFDANDROID");
+
+	return create_sync && destroy_sync && dup_native_fence_fd;
+}
+
+/*
+ * Returns a sync_file fd that signals once the GPU has finished
+ * everything submitted so far, or -1.
+ */
+int gl_fence_fd(EGLDisplay dpy)
+{
+	EGLSyncKHR sync;
+	int fd;
+
+	if (!create_sync)
+		return -1;
+
+	sync = create_sync(dpy, EGL_SYNC_NATIVE_FENCE_ANDROID, NULL);
+	if (sync == EGL_NO_SYNC_KHR)
+		return -1;
+
+	/* the fd only exists once the fence has been flushed: */
+	glFlush();
+
+	fd = dup_native_fence_fd(dpy, sync);
+	destroy_sync(dpy, sync);
+
+	return fd == EGL_NO_NATIVE_FENCE_FD_ANDROID ? -1 : fd;
+}
+
+bool gl_image_init(EGLDisplay dpy)
+{
+	const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+
+	if (!exts || !strstr(exts, "EGL_EXT_image_dma_buf_import"))
+		return false;
+
+	create_image = (PFNEGLCREATEIMAGEKHRPROC)
+		eglGetProcAddress("eglCreateImageKHR");
+	destroy_image = (PFNEGLDESTROYIMAGEKHRPROC)
+		eglGetProcAddress("eglDestroyImageKHR");
+	image_target_renderbuffer_storage = (PFNGLEGLIMAGETARGETRENDERBUFFERSTORAGEOESPROC)
+		eglGetProcAddress("glEGLImageTargetRenderbufferStorageOES");
+
+	return create_image && destroy_image && image_target_renderbuffer_storage;
+}
+
+/* buffers with an explicit layout need it passed on to EGL */
+bool gl_image_modifiers(EGLDisplay dpy)
+{
+	const char *exts = eglQueryString(dpy, EGL_EXTENSIONS);
+
+	return exts && strstr(exts, "EGL_EXT_image_dma_buf_import_modifiers");
+}
+
+/*
+ * An RGB buffer comes in whole, with any extra planes its modifier
+ * needs.  Each plane of a YUV buffer comes in by itself, as the one
+ * or two channel format GL can render it as.
+ */
+static EGLImageKHR import_buffer(EGLDisplay dpy, struct surface *s, struct buffer *b,
+				 int plane)
+{
+	static const EGLint plane_attrs[4][5] = {
+		{
+			EGL_DMA_BUF_PLANE0_FD_EXT,
+			EGL_DMA_BUF_PLANE0_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE0_PITCH_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE0_MODIFIER_HI_EXT,
+		}, {
+			EGL_DMA_BUF_PLANE1_FD_EXT,
+			EGL_DMA_BUF_PLANE1_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE1_PITCH_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE1_MODIFIER_HI_EXT,
+		}, {
+			EGL_DMA_BUF_PLANE2_FD_EXT,
+			EGL_DMA_BUF_PLANE2_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE2_PITCH_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE2_MODIFIER_HI_EXT,
+		}, {
+			EGL_DMA_BUF_PLANE3_FD_EXT,
+			EGL_DMA_BUF_PLANE3_OFFSET_EXT,
+			EGL_DMA_BUF_PLANE3_PITCH_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_LO_EXT,
+			EGL_DMA_BUF_PLANE3_MODIFIER_HI_EXT,
+		},
+	};
+	const struct format_info *info = s->info;
+	EGLint attribs[6 + 4 * 10 + 1];
+	EGLImageKHR image;
+	int first, count;
+	int i, n = 0;
+	/* the planes of a gbm bo all live in the one dma-buf */
+	int fd = gbm_bo_get_fd(b->bo);
+
+	if (fd < 0)
+		return EGL_NO_IMAGE_KHR;
+
+	attribs[n++] = EGL_WIDTH;
+	attribs[n++] = s->width / info->planes[plane].hsub;
+	attribs[n++] = EGL_HEIGHT;
+	attribs[n++] = s->height / info->planes[plane].vsub;
+	attribs[n++] = EGL_LINUX_DRM_FOURCC_EXT;
+	attribs[n++] = info->planes[plane].format;
+
+	if (format_is_yuv(info)) {
+		first = plane;
+		count = 1;
+	} else {
+		first = 0;
+		count = b->count_planes;
+	}
+
+	for (i = 0; i < count; i++) {
+		attribs[n++] = plane_attrs[i][0];
+		attribs[n++] = fd;
+		attribs[n++] = plane_attrs[i][1];
+		attribs[n++] = b->offset[first + i];
+		attribs[n++] = plane_attrs[i][2];
+		attribs[n++] = b->stride[first + i];
+		if (b->modifier != DRM_FORMAT_MOD_INVALID) {
+			attribs[n++] = plane_attrs[i][3];
+			attribs[n++] = b->modifier & 0xffffffff;
+			attribs[n++] = plane_attrs[i][4];
+			attribs[n++] = b->modifier >> 32;
+		}
+	}
+
+	attribs[n] = EGL_NONE;
+
+	image = create_image(dpy, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+
+	/* the image holds its own reference */
+	close(fd);
+
+	return image;
+}
+
+/* GL planes per buffer: one, unless GL has to draw YUV a plane at a time */
+static int gl_planes(const struct my_surface *s)
+{
+	return format_is_yuv(s->base.info) ? s->base.info->count_planes : 1;
 }
 
 void gl_surf_fini(EGLDisplay dpy, struct my_surface *s)
 {
-	glDeleteFramebuffers(2, s->fbo);
-	glDeleteTextures(2, s->tex);
+	unsigned int i;
+	int j;
+
+	glDeleteFramebuffers(3, s->fbo);
+	glDeleteTextures(3, s->tex);
+
+	for (i = 0; i < s->base.depth; i++) {
+		glDeleteFramebuffers(gl_planes(s), s->fb[i]);
+		glDeleteRenderbuffers(gl_planes(s), s->rb[i]);
+		for (j = 0; j < gl_planes(s); j++) {
+			if (s->image[i][j] != EGL_NO_IMAGE_KHR)
+				destroy_image(dpy, s->image[i][j]);
+			s->image[i][j] = EGL_NO_IMAGE_KHR;
+		}
+	}
+}
 
-	eglDestroySurface(dpy, s->egl_surface);
+/*
+ * Rendering goes straight into the swapchain's buffers, each one
+ * imported as an EGLImage and made the storage of a renderbuffer.
+ * There's no window surface, the context stays current without one.
+ */
+static bool gl_surf_init_buffers(EGLDisplay dpy, struct my_surface *s)
+{
+	unsigned int i;
+	int j;
+
+	for (i = 0; i < s->base.depth; i++) {
+		glGenRenderbuffers(gl_planes(s), s->rb[i]);
+		glGenFramebuffers(gl_planes(s), s->fb[i]);
+
+		for (j = 0; j < gl_planes(s); j++) {
+			s->image[i][j] = import_buffer(dpy, &s->base, &s->base.buffers[i], j);
+			if (s->image[i][j] == EGL_NO_IMAGE_KHR)
+				return false;
+
+			glBindRenderbuffer(GL_RENDERBUFFER, s->rb[i][j]);
+			image_target_renderbuffer_storage(GL_RENDERBUFFER, s->image[i][j]);
+
+			glBindFramebuffer(GL_FRAMEBUFFER, s->fb[i][j]);
+			glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+						  GL_RENDERBUFFER, s->rb[i][j]);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				return false;
+		}
+	}
+
+	glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+	return true;
 }
 
-bool gl_surf_init(EGLDisplay dpy, EGLConfig config, struct my_surface *s)
+static bool init_texture(GLuint fbo, GLuint tex, GLint filter,
+			 GLint internal_format, GLenum format, GLenum type,
+			 unsigned int width, unsigned int height)
+{
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, NULL);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, tex, 0);
+
+	return glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+}
+
+static bool has_gl_ext(const char *name)
+{
+	const char *exts = (const char *) glGetString(GL_EXTENSIONS);
+
+	return exts && strstr(exts, name);
+}
+
+bool gl_surf_init(EGLDisplay dpy, struct my_surface *s)
 {
 	GLint internal_format;
 	GLenum type, format;
 
-	s->egl_surface = eglCreateWindowSurface(dpy, config, (EGLNativeWindowType)s->base.gbm_surface, NULL);
-	if (s->egl_surface == EGL_NO_SURFACE)
+	/* GL draws YUV a plane at a time, and only knows the two plane kind */
+	if (gl_planes(s) > 2)
 		return false;
 
-	switch (32) {
-	case 12:
-		internal_format = GL_RGBA;
-		type = GL_UNSIGNED_SHORT_4_4_4_4;
-		format = GL_RGBA;
-		break;
-	case 15:
-		internal_format = GL_RGBA;
-		type = GL_UNSIGNED_SHORT_5_5_5_1;
-		format = GL_RGBA;
-		break;
-	case 16:
+	s->gl = true;
+
+	if (!gl_surf_init_buffers(dpy, s))
+		return false;
+
+	/*
+	 * The intermediate frames are kept at the precision of the
+	 * buffers, so the passes cost no more bandwidth than the
+	 * format saves.  YUV is drawn as RGB first.  GLES2 wants the
+	 * internal format to be the format, the type says the rest,
+	 * and without the 10 bit type the passes are 8 bit.
+	 */
+	switch (s->base.fmt) {
+	case DRM_FORMAT_RGB565:
 		internal_format = GL_RGB;
 		type = GL_UNSIGNED_SHORT_5_6_5;
 		format = GL_RGB;
 		break;
-	case 24:
-		internal_format = GL_RGB;
-		type = GL_UNSIGNED_BYTE;
-		format = GL_RGB;
-		break;
-	case 32:
+	case DRM_FORMAT_XRGB2101010:
+		if (has_gl_ext("GL_EXT_texture_type_2_10_10_10_REV")) {
+			internal_format = GL_RGBA;
+			type = GL_UNSIGNED_INT_2_10_10_10_REV_EXT;
+			format = GL_RGBA;
+			break;
+		}
+		/* fall through */
+	default:
 		internal_format = GL_RGBA;
 		type = GL_UNSIGNED_BYTE;
 		format = GL_RGBA;
 		break;
 	}
 
-	glGenFramebuffers(2, s->fbo);
-	glGenTextures(2, s->tex);
+	glGenFramebuffers(3, s->fbo);
+	glGenTextures(3, s->tex);
 
-	glBindTexture(GL_TEXTURE_2D, s->tex[0]);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, s->base.width, s->base.height, 0, format, type, NULL);
-	glBindFramebuffer(GL_FRAMEBUFFER, s->fbo[0]);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s->tex[0], 0);
+	if (!init_texture(s->fbo[0], s->tex[0], GL_NEAREST, internal_format, format, type,
+			  s->base.width, s->base.height) ||
+	    !init_texture(s->fbo[1], s->tex[1], GL_NEAREST, internal_format, format, type,
+			  s->base.width, s->base.height))
+		return false;
 
-	glBindTexture(GL_TEXTURE_2D, s->tex[1]);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-	glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, s->base.width, s->base.height, 0, format, type, NULL);
-	glBindFramebuffer(GL_FRAMEBUFFER, s->fbo[1]);
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, s->tex[1], 0);
+	if (format_is_yuv(s->base.info) &&
+	    !init_texture(s->fbo[2], s->tex[2], GL_LINEAR, internal_format, format, type,
+			  s->base.width, s->base.height))
+		return false;
 
 	return true;
 }
@@ -29,12 +29,21 @@
 bool gl_init(void);
 void gl_fini(void);
 
-bool gl_surf_init(EGLDisplay dpy, EGLConfig config, struct my_surface *s);
+bool gl_image_init(EGLDisplay dpy);
+bool gl_image_modifiers(EGLDisplay dpy);
+
+bool gl_surf_init(EGLDisplay dpy, struct my_surface *s);
 void gl_surf_fini(EGLDisplay dpy, struct my_surface *s);
+bool gl_surf_bind(struct my_surface *s);
+void gl_surf_resolve(struct my_surface *s);
 
 void gl_surf_render(EGLDisplay dpy, EGLContext ctx,
 		    struct my_surface *surf,
-		    bool col, bool anim, bool blur);
+		    bool col, bool anim, bool blur,
+		    uint64_t now);
+
+bool gl_fence_init(EGLDisplay dpy);
+int gl_fence_fd(EGLDisplay dpy);
 
 void gl_surf_clear(EGLDisplay dpy, EGLContext ctx,
 		   struct my_surface *s,
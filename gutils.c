@@ -21,145 +21,643 @@
  * SOFTWARE.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/udmabuf.h>
 #include <gbm.h>
 #include <drm_fourcc.h>
 
 #include <xf86drmMode.h>
 
 #include "gutils.h"
+#include "kms.h"
 
 #define ARRAY_SIZE(a) ((int)(sizeof(a)/sizeof((a)[0])))
 
-bool surface_has_free_buffers(struct surface *s)
+static const struct format_info formats[] = {
+	{ DRM_FORMAT_XRGB8888, "XRGB8888", 1, {
+		{ DRM_FORMAT_XRGB8888, 4, 1, 1 },
+	} },
+	{ DRM_FORMAT_ARGB8888, "ARGB8888", 1, {
+		{ DRM_FORMAT_ARGB8888, 4, 1, 1 },
+	} },
+	{ DRM_FORMAT_XRGB2101010, "XRGB2101010", 1, {
+		{ DRM_FORMAT_XRGB2101010, 4, 1, 1 },
+	} },
+	{ DRM_FORMAT_RGB565, "RGB565", 1, {
+		{ DRM_FORMAT_RGB565, 2, 1, 1 },
+	} },
+	/* luma, then Cb and Cr interleaved at half the size */
+	{ DRM_FORMAT_NV12, "NV12", 2, {
+		{ DRM_FORMAT_R8, 1, 1, 1 },
+		{ DRM_FORMAT_GR88, 2, 2, 2 },
+	} },
+	/* luma, Cb and Cr each in their own plane */
+	{ DRM_FORMAT_YUV420, "YUV420", 3, {
+		{ DRM_FORMAT_R8, 1, 1, 1 },
+		{ DRM_FORMAT_R8, 1, 2, 2 },
+		{ DRM_FORMAT_R8, 1, 2, 2 },
+	} },
+};
+
+const struct format_info *format_lookup(uint32_t format)
 {
-	return gbm_surface_has_free_buffers(s->gbm_surface);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (formats[i].format == format)
+			return &formats[i];
+	}
+
+	return NULL;
 }
 
-void surface_retire_buffers(struct surface *s, int fence)
+const struct format_info *format_lookup_name(const char *name)
 {
 	int i;
 
-	for (i = 0; i < ARRAY_SIZE(s->buffers); i++) {
-		struct buffer *b = &s->buffers[i];
-		if (b->bo && b->fence && (b->fence < fence)) {
-			surface_buffer_put_fb(s, b);
-		}
+	for (i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (!strcasecmp(formats[i].name, name))
+			return &formats[i];
 	}
 
+	return NULL;
+}
+
+static void buffer_free_push(struct surface *s, struct buffer *b)
+{
+	assert(s->count_free < s->depth);
+
+	s->free[s->count_free++] = b;
+}
+
+/*
+ * Buffers only ever come back through surface_buffer_put_fb(), from the
+ * flip and fence handlers, so there's nothing to poll: whether there is
+ * one to render to only changes when an event has been dealt with.
+ */
+bool surface_has_free_buffers(struct surface *s)
+{
+	return s->back || s->count_free;
+}
+
+/* the buffer to render the next frame into, NULL if they're all busy */
+struct buffer *surface_get_back(struct surface *s)
+{
+	if (!s->back && s->count_free)
+		s->back = s->free[--s->count_free];
+
+	return s->back;
+}
+
+/*
+ * The back buffer becomes the front, to be picked up by
+ * surface_get_front().  A front buffer nobody picked up is stale now
+ * and goes straight back on the free list.
+ */
+void surface_swap(struct surface *s)
+{
+	if (!surface_get_back(s))
+		return;
+
+	if (s->front)
+		buffer_free_push(s, s->front);
+
+	s->front = s->back;
+	s->back = NULL;
+}
+
+/* a frame that won't be shown after all: its front goes back on the free list */
+void surface_drop_front(struct surface *s)
+{
+	if (!s->front)
+		return;
+
+	buffer_free_push(s, s->front);
+	s->front = NULL;
+}
+
+void surface_buffer_queue(struct surface *s, struct buffer *b, int fence)
+{
+	unsigned int tail;
+
+	assert(s->queue_len < ARRAY_SIZE(s->queue));
+
+	tail = (s->queue_head + s->queue_len) % ARRAY_SIZE(s->queue);
+	s->queue[tail] = b;
+	s->queue_len++;
+
+	b->fence = fence;
+}
+
+/*
+ * A buffer is scanned out until the next one queued for the same plane
+ * reaches the screen, however many commits go by without touching the
+ * plane in between. Fences complete in order, so only the head of the
+ * queue and the one after it ever need to be looked at.
+ */
+void surface_retire_buffers(struct surface *s, int fence)
+{
+	while (s->queue_len > 1) {
+		struct buffer *b = s->queue[s->queue_head];
+		struct buffer *next = s->queue[(s->queue_head + 1) % ARRAY_SIZE(s->queue)];
+
+		if (next->fence > fence)
+			break;
+
+		s->queue_head = (s->queue_head + 1) % ARRAY_SIZE(s->queue);
+		s->queue_len--;
+
+		surface_buffer_put_fb(s, b);
+	}
 }
 
 void surface_buffer_put_fb(struct surface *s, struct buffer *b)
 {
-	b->ref--;
+	assert(b->ref > 0);
+
 	b->fence = 0;
-	gbm_surface_release_buffer(s->gbm_surface, b->bo);
+	if (--b->ref == 0)
+		buffer_free_push(s, b);
 }
 
-static void buffer_nuke(struct gbm_bo *bo, void *data)
+struct buffer *surface_get_front(int fd, struct surface *s)
 {
-	struct buffer *b = data;
+	struct buffer *b = s->front;
+
+	if (!b)
+		return NULL;
 
 	assert(b->ref == 0);
+	assert(b->fd == fd);
 
-	drmModeRmFB(b->fd, b->fb_id);
+	s->front = NULL;
+	b->ref = 1;
+
+	return b;
 }
 
-struct buffer *surface_get_front(int fd, struct surface *s)
+static void buffer_fini(struct buffer *b)
+{
+	if (b->fb_id)
+		kms->rm_fb(b->fd, b->fb_id);
+	if (b->map && b->dumb)
+		kms->unmap_dumb(b->map, b->size);
+	else if (b->map)
+		munmap(b->map, b->size);
+	if (b->dumb)
+		kms->destroy_dumb(b->fd, b->handle[0]);
+	if (b->udmabuf)
+		close(b->dmabuf_fd);
+	if (b->prime)
+		kms->close_handle(b->fd, b->handle[0]);
+	if (b->bo)
+		gbm_bo_destroy(b->bo);
+	memset(b, 0, sizeof *b);
+}
+
+static void surface_free_buffers(struct surface *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < s->depth; i++)
+		buffer_fini(&s->buffers[i]);
+
+	s->count_free = 0;
+}
+
+void surface_free(struct surface *s)
 {
-	struct gbm_bo *bo;
-	struct buffer *b;
+	surface_free_buffers(s);
+	memset(s, 0, sizeof *s);
+}
+
+static bool buffer_add_fb(struct buffer *b, struct surface *s)
+{
+	uint64_t modifiers[4] = {};
 	int i;
 
-	bo = gbm_surface_lock_front_buffer(s->gbm_surface);
-	if (!bo)
-		return NULL;
+	if (b->modifier == DRM_FORMAT_MOD_INVALID)
+		return !kms->add_fb2(b->fd, s->width, s->height, s->fmt,
+				     b->handle, b->stride, b->offset, &b->fb_id, 0);
 
-	b = gbm_bo_get_user_data(bo);
-	if (b) {
-		assert(b->ref >= 0);
-		assert(b->bo == bo);
-		b->ref++;
-		return b;
-	}
+	for (i = 0; i < b->count_planes; i++)
+		modifiers[i] = b->modifier;
 
-	for (i = 0; i < ARRAY_SIZE(s->buffers); i++) {
-		if (!s->buffers[i].bo) {
-			b = &s->buffers[i];
-			break;
-		}
+	return !kms->add_fb2_with_modifiers(b->fd, s->width, s->height, s->fmt,
+					    b->handle, b->stride, b->offset, modifiers,
+					    &b->fb_id, DRM_MODE_FB_MODIFIERS);
+}
+
+/*
+ * The planes of a YUV buffer one after the other, all with the same
+ * handle, given the pitch of the first.
+ */
+static void buffer_layout_planes(struct buffer *b, const struct surface *s,
+				 uint32_t handle, uint32_t pitch)
+{
+	const struct format_info *info = s->info;
+	uint32_t offset = 0;
+	int i;
+
+	b->count_planes = info->count_planes;
+
+	for (i = 0; i < info->count_planes; i++) {
+		b->handle[i] = handle;
+		b->stride[i] = pitch * info->planes[i].cpp /
+			info->planes[i].hsub / info->planes[0].cpp;
+		b->offset[i] = offset;
+		offset += b->stride[i] * (s->height / info->planes[i].vsub);
 	}
 
-	if (!b) {
-		gbm_surface_release_buffer(s->gbm_surface, bo);
-		return NULL;
+	b->size = offset;
+}
+
+/* rows of luma-sized single byte pixels that hold every plane */
+static unsigned int yuv_rows(const struct surface *s)
+{
+	const struct format_info *info = s->info;
+	unsigned int rows = 0;
+	int i;
+
+	/* a quarter-size plane needn't fill a whole row */
+	for (i = 0; i < info->count_planes; i++) {
+		unsigned int div = info->planes[i].hsub * info->planes[0].cpp;
+
+		rows += (s->height / info->planes[i].vsub *
+			 info->planes[i].cpp + div - 1) / div;
 	}
 
-	memset(b, 0, sizeof *b);
+	return rows;
+}
+
+/*
+ * Without a gbm device the buffers have made-up handles, for backends
+ * that don't need real memory, and take the first modifier offered.
+ *
+ * YUV buffers are a single linear R8 bo tall enough for all the
+ * planes, which every driver can allocate and render to a plane
+ * at a time.
+ */
+static bool buffer_init(struct buffer *b, int fd, struct gbm_device *gbm,
+			struct surface *s, uint32_t usage,
+			const uint64_t *modifiers, unsigned int count_modifiers,
+			unsigned int i)
+{
+	int j;
 
 	b->fd = fd;
-	b->ref = 1;
-	b->bo = bo;
-	b->handle[0] = gbm_bo_get_handle(bo).u32;
-	b->stride[0] = gbm_bo_get_stride(bo);
-	b->size = b->stride[0] * s->height;
-
-	if (drmModeAddFB2(fd, s->width, s->height, s->fmt, b->handle, b->stride, b->offset, &b->fb_id, 0)) {
-		gbm_surface_release_buffer(s->gbm_surface, bo);
-		b->ref = 0;
-		return NULL;
+	b->modifier = DRM_FORMAT_MOD_INVALID;
+	b->count_planes = 1;
+
+	if (!gbm) {
+		if (format_is_yuv(s->info)) {
+			buffer_layout_planes(b, s, i + 1, s->width);
+		} else {
+			b->handle[0] = i + 1;
+			b->stride[0] = s->width * s->info->planes[0].cpp;
+			b->size = b->stride[0] * s->height;
+		}
+		if (count_modifiers)
+			b->modifier = modifiers[0];
+	} else if (format_is_yuv(s->info)) {
+		b->bo = gbm_bo_create(gbm, s->width, yuv_rows(s), GBM_FORMAT_R8,
+				      GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR);
+		if (!b->bo)
+			return false;
+
+		buffer_layout_planes(b, s, gbm_bo_get_handle(b->bo).u32,
+				     gbm_bo_get_stride(b->bo));
+	} else if (count_modifiers) {
+		/* gbm picks the best of them the render device can do */
+		b->bo = gbm_bo_create_with_modifiers(gbm, s->width, s->height, s->fmt,
+						     modifiers, count_modifiers);
+		if (!b->bo)
+			return false;
+
+		b->modifier = gbm_bo_get_modifier(b->bo);
+		b->count_planes = gbm_bo_get_plane_count(b->bo);
+		if (b->count_planes < 1 || b->count_planes > 4)
+			return false;
+
+		for (j = 0; j < b->count_planes; j++) {
+			b->handle[j] = gbm_bo_get_handle_for_plane(b->bo, j).u32;
+			b->stride[j] = gbm_bo_get_stride_for_plane(b->bo, j);
+			b->offset[j] = gbm_bo_get_offset(b->bo, j);
+		}
+		b->size = b->stride[0] * s->height;
+	} else {
+		b->bo = gbm_bo_create(gbm, s->width, s->height, s->fmt, usage);
+		if (!b->bo)
+			return false;
+
+		b->handle[0] = gbm_bo_get_handle(b->bo).u32;
+		b->stride[0] = gbm_bo_get_stride(b->bo);
+		b->size = b->stride[0] * s->height;
 	}
 
-	gbm_bo_set_user_data(bo, b, buffer_nuke);
+	if (s->prime) {
+		int prime_fd = gbm_bo_get_fd(b->bo);
+		uint32_t handle;
 
-	return b;
+		if (prime_fd < 0)
+			return false;
+		if (kms->prime_fd_to_handle(fd, prime_fd, &handle)) {
+			close(prime_fd);
+			return false;
+		}
+		close(prime_fd);
+
+		for (j = 0; j < b->count_planes; j++)
+			b->handle[j] = handle;
+		b->prime = true;
+	}
+
+	return buffer_add_fb(b, s);
 }
 
-void surface_free(struct surface *s)
+static bool surface_alloc_buffers(struct surface *s, int fd, struct gbm_device *gbm,
+				  uint32_t usage,
+				  const uint64_t *modifiers, unsigned int count_modifiers)
 {
-	if (!s->gbm_surface)
-		return;
+	unsigned int i;
+
+	for (i = 0; i < s->depth; i++) {
+		struct buffer *b = &s->buffers[i];
+
+		if (!buffer_init(b, fd, gbm, s, usage,
+				 modifiers, count_modifiers, i)) {
+			surface_free_buffers(s);
+			return false;
+		}
+		buffer_free_push(s, b);
+	}
+
+	return true;
+}
+
+static bool surface_init(struct surface *s, unsigned int fmt,
+			 unsigned int width, unsigned int height,
+			 unsigned int depth)
+{
+	const struct format_info *info = format_lookup(fmt);
+
+	if (!info)
+		return false;
+
+	if (depth < 2 || depth > SURFACE_MAX_DEPTH)
+		return false;
+
+	/* chroma planes don't come in half pixels */
+	if (format_is_yuv(info) && (width & 1 || height & 1))
+		return false;
 
-	gbm_surface_destroy(s->gbm_surface);
 	memset(s, 0, sizeof *s);
+
+	s->fmt = fmt;
+	s->info = info;
+	s->width = width;
+	s->height = height;
+	s->depth = depth;
+
+	return true;
 }
 
+/*
+ * Everything is allocated and has its fb up front, so a frame never
+ * has to wait on either.
+ *
+ * The modifiers are the layouts the plane can scan out, from its
+ * IN_FORMATS.  If none of them works out, on either the render or the
+ * display side, the surface falls back to plain linear buffers.
+ */
 bool surface_alloc(struct surface *s,
+		   int fd,
 		   struct gbm_device *gbm,
 		   unsigned int fmt,
 		   unsigned int width,
-		   unsigned int height)
+		   unsigned int height,
+		   unsigned int depth,
+		   const uint64_t *modifiers,
+		   unsigned int count_modifiers)
 {
-	uint32_t gbm_fmt;
+	uint32_t usage = 0;
 
-	switch (fmt) {
-	case DRM_FORMAT_XRGB8888:
-		gbm_fmt = GBM_FORMAT_XRGB8888;
-		break;
-	case DRM_FORMAT_ARGB8888:
-		gbm_fmt = GBM_FORMAT_ARGB8888;
-		break;
-	default:
+	if (!surface_init(s, fmt, width, height, depth))
 		return false;
+
+	/*
+	 * Another device can only be trusted to understand linear
+	 * buffers, and the render device may not be able to scan out
+	 * at all.
+	 */
+	if (gbm) {
+		s->prime = gbm_device_get_fd(gbm) != fd;
+		if (s->prime)
+			usage = GBM_BO_USE_RENDERING | GBM_BO_USE_LINEAR;
+		else
+			usage = GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING;
 	}
 
-	memset(s, 0, sizeof *s);
+	/* the R8 bo behind a YUV surface is linear already */
+	if (!count_modifiers || s->prime || (gbm && format_is_yuv(s->info)))
+		return surface_alloc_buffers(s, fd, gbm, usage, NULL, 0);
 
-	s->fmt = fmt;
-	s->width = width;
-	s->height = height;
+	if (surface_alloc_buffers(s, fd, gbm, usage, modifiers, count_modifiers))
+		return true;
+
+	return surface_alloc_buffers(s, fd, gbm, usage | GBM_BO_USE_LINEAR, NULL, 0);
+}
+
+static bool buffer_init_dumb(struct buffer *b, int fd, struct surface *s)
+{
+	const struct format_info *info = s->info;
+	uint32_t handle, pitch;
+	uint64_t size;
+
+	b->fd = fd;
+	b->modifier = DRM_FORMAT_MOD_INVALID;
+	b->count_planes = 1;
+
+	if (format_is_yuv(info)) {
+		if (kms->create_dumb(fd, s->width, yuv_rows(s), info->planes[0].cpp * 8,
+				     &handle, &pitch, &size))
+			return false;
+
+		b->dumb = true;
+		buffer_layout_planes(b, s, handle, pitch);
+	} else {
+		if (kms->create_dumb(fd, s->width, s->height, info->planes[0].cpp * 8,
+				     &handle, &pitch, &size))
+			return false;
+
+		b->dumb = true;
+		b->handle[0] = handle;
+		b->stride[0] = pitch;
+	}
 
-	s->gbm_surface = gbm_surface_create(gbm, width, height, gbm_fmt, GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
-	if (!s->gbm_surface) {
-		memset(s, 0, sizeof *s);
+	b->size = size;
+	b->map = kms->map_dumb(fd, handle, size);
+	if (!b->map)
 		return false;
+
+	return buffer_add_fb(b, s);
+}
+
+/*
+ * Buffers the CPU fills in, straight from the display device with no
+ * GPU involved.  A YUV buffer is a single dumb buffer holding all the
+ * planes, laid out as for rendering.
+ */
+bool surface_alloc_dumb(struct surface *s,
+			int fd,
+			unsigned int fmt,
+			unsigned int width,
+			unsigned int height,
+			unsigned int depth)
+{
+	unsigned int i;
+
+	if (!surface_init(s, fmt, width, height, depth))
+		return false;
+
+	for (i = 0; i < depth; i++) {
+		struct buffer *b = &s->buffers[i];
+
+		if (!buffer_init_dumb(b, fd, s)) {
+			surface_free(s);
+			return false;
+		}
+		buffer_free_push(s, b);
 	}
 
 	return true;
 }
 
+/*
+ * Makes an fb of a dma-buf someone else produced, every plane of s's
+ * format in the one dma-buf at the offsets and pitches given.  The
+ * handle is ours to close, dmabuf_fd stays the caller's.
+ */
+bool buffer_import_dmabuf(struct buffer *b, struct surface *s, int fd,
+			  int dmabuf_fd, const uint32_t offsets[4],
+			  const uint32_t pitches[4], uint64_t modifier)
+{
+	uint32_t handle;
+	int i;
+
+	b->fd = fd;
+	b->modifier = modifier;
+	b->count_planes = s->info->count_planes;
+
+	if (kms->prime_fd_to_handle(fd, dmabuf_fd, &handle))
+		return false;
+	b->prime = true;
+
+	for (i = 0; i < b->count_planes; i++) {
+		b->handle[i] = handle;
+		b->offset[i] = offsets[i];
+		b->stride[i] = pitches[i];
+	}
+
+	return buffer_add_fb(b, s);
+}
+
+static bool buffer_init_udmabuf(struct buffer *b, int fd, struct surface *s,
+				int udmabuf, int memfd, uint64_t offset,
+				uint32_t size, const struct buffer *layout)
+{
+	struct udmabuf_create create = {
+		.memfd = memfd,
+		.flags = UDMABUF_FLAGS_CLOEXEC,
+		.offset = offset,
+		.size = size,
+	};
+
+	b->dmabuf_fd = ioctl(udmabuf, UDMABUF_CREATE, &create);
+	if (b->dmabuf_fd < 0)
+		return false;
+	b->udmabuf = true;
+
+	b->size = size;
+	b->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, offset);
+	if (b->map == MAP_FAILED) {
+		b->map = NULL;
+		return false;
+	}
+
+	return buffer_import_dmabuf(b, s, fd, b->dmabuf_fd, layout->offset,
+				    layout->stride, DRM_FORMAT_MOD_INVALID);
+}
+
+/*
+ * Buffers that come from outside the display device: memfd pages
+ * wrapped as dma-bufs by udmabuf, the way a decoder or camera hands
+ * over its output, and imported with no copy.  Every plane is laid
+ * out as for a dumb buffer, with a 64 byte aligned pitch.
+ */
+bool surface_alloc_udmabuf(struct surface *s,
+			   int fd,
+			   unsigned int fmt,
+			   unsigned int width,
+			   unsigned int height,
+			   unsigned int depth)
+{
+	long page = sysconf(_SC_PAGESIZE);
+	struct buffer layout = {};
+	uint32_t size;
+	int udmabuf, memfd;
+	unsigned int i;
+	bool ret = false;
+
+	if (!surface_init(s, fmt, width, height, depth))
+		return false;
+
+	udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (udmabuf < 0)
+		return false;
+
+	memfd = memfd_create("glplane", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0)
+		goto out_udmabuf;
+
+	/* udmabuf wants whole pages, and the memfd not to shrink under it */
+	buffer_layout_planes(&layout, s, 0, (width * s->info->planes[0].cpp + 63) & ~63);
+	size = (layout.size + page - 1) & ~(page - 1);
+
+	if (ftruncate(memfd, (off_t) size * depth) ||
+	    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK))
+		goto out_memfd;
+
+	for (i = 0; i < depth; i++) {
+		struct buffer *b = &s->buffers[i];
+
+		if (!buffer_init_udmabuf(b, fd, s, udmabuf, memfd,
+					 (uint64_t) size * i, size, &layout)) {
+			surface_free(s);
+			goto out_memfd;
+		}
+		buffer_free_push(s, b);
+	}
+
+	/* the dma-bufs and mappings hold on to the pages */
+	ret = true;
+out_memfd:
+	close(memfd);
+out_udmabuf:
+	close(udmabuf);
+
+	return ret;
+}
+
 bool bo_alloc(struct bo *b,
 	      struct gbm_device *gbm,
 	      unsigned int fmt,
@@ -35,16 +35,74 @@ struct buffer {
 	uint32_t stride[4];
 	uint32_t handle[4];
 	uint32_t fb_id;
+	/* layout of every plane, DRM_FORMAT_MOD_INVALID if left to the driver */
+	uint64_t modifier;
+	int count_planes;
 	int ref;
+	/* handle[0] was imported from the render device and is ours to close */
+	bool prime;
 	struct gbm_bo *bo;
+	/*
+	 * Written by the CPU through map, size bytes of it: a dumb buffer,
+	 * or a udmabuf over memfd pages that was imported as handle[0].
+	 */
+	bool dumb;
+	bool udmabuf;
+	int dmabuf_fd;
+	void *map;
 };
 
+#define FORMAT_MAX_PLANES 3
+
+/* how a format is laid out, and how GL gets to draw each of its planes */
+struct format_info {
+	uint32_t format;
+	const char *name;
+	int count_planes;
+	struct {
+		/* the format GL renders the plane as */
+		uint32_t format;
+		int cpp;
+		/* subsampling against the first plane */
+		int hsub;
+		int vsub;
+	} planes[FORMAT_MAX_PLANES];
+};
+
+const struct format_info *format_lookup(uint32_t format);
+const struct format_info *format_lookup_name(const char *name);
+
+static inline bool format_is_yuv(const struct format_info *info)
+{
+	return info->count_planes > 1;
+}
+
+/* how many buffers a surface can have: double, triple or quad buffering */
+#define SURFACE_MAX_DEPTH 4
+
+/*
+ * A fixed swapchain.  A buffer is in exactly one place at a time: on
+ * the free list, the back buffer being rendered to, the front buffer
+ * waiting to be shown, or with the display until it's put back.
+ */
 struct surface {
-	struct gbm_surface *gbm_surface;
-	struct buffer buffers[8];
+	struct buffer buffers[SURFACE_MAX_DEPTH];
+	unsigned int depth;
+	/* buffers nobody holds, used as a stack */
+	struct buffer *free[SURFACE_MAX_DEPTH];
+	unsigned int count_free;
+	struct buffer *back;
+	struct buffer *front;
+	/* buffers handed to the display, oldest fence first */
+	struct buffer *queue[SURFACE_MAX_DEPTH];
+	unsigned int queue_head;
+	unsigned int queue_len;
 	unsigned int width;
 	unsigned int height;
 	uint32_t fmt;
+	const struct format_info *info;
+	/* rendered on a different device than the one scanning out */
+	bool prime;
 };
 
 struct bo {
@@ -55,11 +113,17 @@ struct bo {
 };
 
 struct gbm_device;
-struct gbm_surface;
 struct gbm_bo;
 
 bool surface_has_free_buffers(struct surface *s);
 
+struct buffer *surface_get_back(struct surface *s);
+
+void surface_swap(struct surface *s);
+void surface_drop_front(struct surface *s);
+
+void surface_buffer_queue(struct surface *s, struct buffer *b, int fence);
+
 void surface_retire_buffers(struct surface *s, int fence);
 
 void surface_buffer_put_fb(struct surface *s, struct buffer *b);
@@ -69,10 +133,32 @@ struct buffer *surface_get_front(int fd, struct surface *s);
 void surface_free(struct surface *s);
 
 bool surface_alloc(struct surface *s,
+		   int fd,
 		   struct gbm_device *gbm,
 		   unsigned int fmt,
 		   unsigned int width,
-		   unsigned int height);
+		   unsigned int height,
+		   unsigned int depth,
+		   const uint64_t *modifiers,
+		   unsigned int count_modifiers);
+
+bool surface_alloc_dumb(struct surface *s,
+			int fd,
+			unsigned int fmt,
+			unsigned int width,
+			unsigned int height,
+			unsigned int depth);
+
+bool buffer_import_dmabuf(struct buffer *b, struct surface *s, int fd,
+			  int dmabuf_fd, const uint32_t offsets[4],
+			  const uint32_t pitches[4], uint64_t modifier);
+
+bool surface_alloc_udmabuf(struct surface *s,
+			   int fd,
+			   unsigned int fmt,
+			   unsigned int width,
+			   unsigned int height,
+			   unsigned int depth);
 
 
 bool bo_alloc(struct bo *bo,
@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "device.h"
+#include "kms.h"
+
+static int drm_open(const char *spec)
+{
+	return open_device(spec, DRM_NODE_PRIMARY);
+}
+
+static int drm_close(int fd)
+{
+	return close(fd);
+}
+
+static int drm_close_handle(int fd, uint32_t handle)
+{
+	struct drm_gem_close req = {
+		.handle = handle,
+	};
+
+	return drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &req);
+}
+
+static int drm_create_dumb(int fd, uint32_t width, uint32_t height, uint32_t bpp,
+			   uint32_t *handle, uint32_t *pitch, uint64_t *size)
+{
+	struct drm_mode_create_dumb req = {
+		.width = width,
+		.height = height,
+		.bpp = bpp,
+	};
+	int ret;
+
+	ret = drmIoctl(fd, DRM_IOCTL_MODE_CREATE_DUMB, &req);
+	if (ret)
+		return ret;
+
+	*handle = req.handle;
+	*pitch = req.pitch;
+	*size = req.size;
+
+	return 0;
+}
+
+static void *drm_map_dumb(int fd, uint32_t handle, uint64_t size)
+{
+	struct drm_mode_map_dumb req = {
+		.handle = handle,
+	};
+	void *map;
+
+	if (drmIoctl(fd, DRM_IOCTL_MODE_MAP_DUMB, &req))
+		return NULL;
+
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, req.offset);
+
+	return map == MAP_FAILED ? NULL : map;
+}
+
+static void drm_unmap_dumb(void *map, uint64_t size)
+{
+	munmap(map, size);
+}
+
+static int drm_destroy_dumb(int fd, uint32_t handle)
+{
+	struct drm_mode_destroy_dumb req = {
+		.handle = handle,
+	};
+
+	return drmIoctl(fd, DRM_IOCTL_MODE_DESTROY_DUMB, &req);
+}
+
+const struct kms_backend kms_drm = {
+	.name = "drm",
+
+	.open = drm_open,
+	.close = drm_close,
+	.set_client_cap = drmSetClientCap,
+	.get_cap = drmGetCap,
+
+	.get_resources = drmModeGetResources,
+	.get_plane_resources = drmModeGetPlaneResources,
+	.get_connector = drmModeGetConnector,
+	.get_connector_current = drmModeGetConnectorCurrent,
+	.get_encoder = drmModeGetEncoder,
+	.get_crtc = drmModeGetCrtc,
+	.get_plane = drmModeGetPlane,
+
+	.get_properties = drmModeObjectGetProperties,
+	.get_property = drmModeGetProperty,
+	.get_property_blob = drmModeGetPropertyBlob,
+	.create_property_blob = drmModeCreatePropertyBlob,
+	.destroy_property_blob = drmModeDestroyPropertyBlob,
+
+	.add_fb2 = drmModeAddFB2,
+	.add_fb2_with_modifiers = drmModeAddFB2WithModifiers,
+	.rm_fb = drmModeRmFB,
+
+	.prime_fd_to_handle = drmPrimeFDToHandle,
+	.close_handle = drm_close_handle,
+
+	.create_dumb = drm_create_dumb,
+	.map_dumb = drm_map_dumb,
+	.unmap_dumb = drm_unmap_dumb,
+	.destroy_dumb = drm_destroy_dumb,
+
+	.set_crtc = drmModeSetCrtc,
+	.set_plane = drmModeSetPlane,
+	.page_flip = drmModePageFlip,
+
+	.atomic_alloc = drmModeAtomicAlloc,
+	.atomic_free = drmModeAtomicFree,
+	.atomic_add_property = drmModeAtomicAddProperty,
+	.atomic_get_cursor = drmModeAtomicGetCursor,
+	.atomic_set_cursor = drmModeAtomicSetCursor,
+	.atomic_commit = drmModeAtomicCommit,
+
+	.handle_event = drmHandleEvent,
+	.get_sequence = drmCrtcGetSequence,
+};
+
+const struct kms_backend *kms = &kms_drm;
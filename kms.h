@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef KMS_H
+#define KMS_H
+
+#include <stdint.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+
+/*
+ * Everything we ask of the display device, so that the same code can
+ * drive a real DRM device or the in-process fake one.  The signatures
+ * are the libdrm ones, and objects returned by a backend are freed with
+ * the usual drmModeFree*() helpers.
+ */
+struct kms_backend {
+	const char *name;
+
+	int (*open)(const char *spec);
+	int (*close)(int fd);
+	int (*set_client_cap)(int fd, uint64_t cap, uint64_t value);
+	int (*get_cap)(int fd, uint64_t cap, uint64_t *value);
+
+	drmModeResPtr (*get_resources)(int fd);
+	drmModePlaneResPtr (*get_plane_resources)(int fd);
+	/* get_connector() may re-probe the hardware, get_connector_current() never does */
+	drmModeConnectorPtr (*get_connector)(int fd, uint32_t connector_id);
+	drmModeConnectorPtr (*get_connector_current)(int fd, uint32_t connector_id);
+	drmModeEncoderPtr (*get_encoder)(int fd, uint32_t encoder_id);
+	drmModeCrtcPtr (*get_crtc)(int fd, uint32_t crtc_id);
+	drmModePlanePtr (*get_plane)(int fd, uint32_t plane_id);
+
+	drmModeObjectPropertiesPtr (*get_properties)(int fd, uint32_t obj_id,
+						     uint32_t obj_type);
+	drmModePropertyPtr (*get_property)(int fd, uint32_t prop_id);
+	drmModePropertyBlobPtr (*get_property_blob)(int fd, uint32_t blob_id);
+	int (*create_property_blob)(int fd, const void *data, size_t length,
+				    uint32_t *blob_id);
+	int (*destroy_property_blob)(int fd, uint32_t blob_id);
+
+	int (*add_fb2)(int fd, uint32_t width, uint32_t height, uint32_t fmt,
+		       const uint32_t handles[4], const uint32_t pitches[4],
+		       const uint32_t offsets[4], uint32_t *fb_id, uint32_t flags);
+	/* for tiled or compressed layouts, with DRM_MODE_FB_MODIFIERS in flags */
+	int (*add_fb2_with_modifiers)(int fd, uint32_t width, uint32_t height, uint32_t fmt,
+				      const uint32_t handles[4], const uint32_t pitches[4],
+				      const uint32_t offsets[4], const uint64_t modifiers[4],
+				      uint32_t *fb_id, uint32_t flags);
+	int (*rm_fb)(int fd, uint32_t fb_id);
+
+	/* buffers rendered on another device come in as dma-bufs */
+	int (*prime_fd_to_handle)(int fd, int prime_fd, uint32_t *handle);
+	int (*close_handle)(int fd, uint32_t handle);
+
+	/* CPU-visible buffers, for content nobody renders */
+	int (*create_dumb)(int fd, uint32_t width, uint32_t height, uint32_t bpp,
+			   uint32_t *handle, uint32_t *pitch, uint64_t *size);
+	void *(*map_dumb)(int fd, uint32_t handle, uint64_t size);
+	void (*unmap_dumb)(void *map, uint64_t size);
+	int (*destroy_dumb)(int fd, uint32_t handle);
+
+	int (*set_crtc)(int fd, uint32_t crtc_id, uint32_t fb_id,
+			uint32_t x, uint32_t y, uint32_t *connectors, int count,
+			drmModeModeInfoPtr mode);
+	/* the pre-atomic way to update a display, one plane at a time */
+	int (*set_plane)(int fd, uint32_t plane_id, uint32_t crtc_id,
+			 uint32_t fb_id, uint32_t flags,
+			 int32_t crtc_x, int32_t crtc_y,
+			 uint32_t crtc_w, uint32_t crtc_h,
+			 uint32_t src_x, uint32_t src_y,
+			 uint32_t src_w, uint32_t src_h);
+	int (*page_flip)(int fd, uint32_t crtc_id, uint32_t fb_id,
+			 uint32_t flags, void *user_data);
+
+	drmModeAtomicReqPtr (*atomic_alloc)(void);
+	void (*atomic_free)(drmModeAtomicReqPtr req);
+	int (*atomic_add_property)(drmModeAtomicReqPtr req, uint32_t obj_id,
+				   uint32_t prop_id, uint64_t value);
+	int (*atomic_get_cursor)(drmModeAtomicReqPtr req);
+	void (*atomic_set_cursor)(drmModeAtomicReqPtr req, int cursor);
+	int (*atomic_commit)(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			     void *user_data);
+
+	int (*handle_event)(int fd, drmEventContextPtr evctx);
+	/* the vblank the CRTC is in now, and when it started */
+	int (*get_sequence)(int fd, uint32_t crtc_id, uint64_t *seq, uint64_t *ns);
+};
+
+extern const struct kms_backend kms_drm;
+extern const struct kms_backend kms_fake;
+
+/* the backend in use, kms_drm unless told otherwise */
+extern const struct kms_backend *kms;
+
+#endif
@@ -0,0 +1,1986 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#include <drm_fourcc.h>
+
+#include "kms.h"
+
+/*
+ * A KMS device that only exists in this process, for profiling the
+ * userspace side of the pipeline without any display hardware.
+ *
+ * It has a configurable number of CRTCs (each with its own primary
+ * plane), overlay planes shared by all CRTCs, and virtual connectors.
+ * Atomic commits are validated and applied to the fake state, flips
+ * land on the next vblank of a clock ticking at the configured refresh
+ * rate, and their events are delivered through a timerfd so the fd can
+ * be select()ed like a real one.  The commit itself can be made to take
+ * a fixed amount of time to mimic the ioctl cost of a real driver.
+ *
+ * The spec given to open() is a comma separated list of
+ * crtcs=, connectors=, planes= (overlays), hz=, latency= (usecs),
+ * probe= (msecs a full connector probe takes), maxplanes= (how many
+ * planes a CRTC can scan out at once, like a real display controller
+ * running out of bandwidth), boot= (1 to start with the displays
+ * lit, the way firmware or fbcon leave them), vrr= (the lowest
+ * refresh rate of an adaptive sync panel, hz= being the highest) and
+ * async= (1 to take tearing flips that only change primary FB_IDs).
+ */
+
+#define MAX_CRTCS	32	/* possible_crtcs is a 32 bit mask */
+#define MAX_CONNECTORS	64
+#define MAX_PLANES	128
+#define MAX_FBS		256
+#define MAX_BLOBS	64
+#define MAX_DUMBS	64
+#define MAX_EVENTS	4
+
+#define CRTC_ID_BASE		100
+#define ENCODER_ID_BASE		200
+#define CONNECTOR_ID_BASE	300
+#define PLANE_ID_BASE		500
+#define FB_ID_BASE		1000
+#define BLOB_ID_BASE		2000	/* IN_FORMATS */
+#define USER_BLOB_ID_BASE	3000	/* whatever userspace creates */
+
+#define ARRAY_SIZE(a) ((int)(sizeof(a)/sizeof((a)[0])))
+
+#define max(a,b) ((a) > (b) ? (a) : (b))
+
+enum {
+	PROP_NONE,
+
+	/* planes */
+	PROP_TYPE,
+	PROP_FB_ID,
+	PROP_CRTC_ID,
+	PROP_SRC_X,
+	PROP_SRC_Y,
+	PROP_SRC_W,
+	PROP_SRC_H,
+	PROP_CRTC_X,
+	PROP_CRTC_Y,
+	PROP_CRTC_W,
+	PROP_CRTC_H,
+	PROP_IN_FENCE_FD,
+	PROP_ZPOS,
+	PROP_IN_FORMATS,
+
+	/* crtcs */
+	PROP_ACTIVE,
+	PROP_MODE_ID,
+	PROP_OUT_FENCE_PTR,
+	PROP_VRR_ENABLED,
+
+	/* connectors */
+	PROP_VRR_CAPABLE,
+
+	PROP_COUNT,
+};
+
+static const struct {
+	const char *name;
+	uint32_t flags;
+} props[PROP_COUNT] = {
+	[PROP_TYPE]		= { "type", DRM_MODE_PROP_ENUM | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_FB_ID]		= { "FB_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC },
+	[PROP_CRTC_ID]		= { "CRTC_ID", DRM_MODE_PROP_OBJECT | DRM_MODE_PROP_ATOMIC },
+	[PROP_SRC_X]		= { "SRC_X", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_SRC_Y]		= { "SRC_Y", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_SRC_W]		= { "SRC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_SRC_H]		= { "SRC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_CRTC_X]		= { "CRTC_X", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_CRTC_Y]		= { "CRTC_Y", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_CRTC_W]		= { "CRTC_W", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_CRTC_H]		= { "CRTC_H", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_IN_FENCE_FD]	= { "IN_FENCE_FD", DRM_MODE_PROP_SIGNED_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_ZPOS]		= { "zpos", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_IN_FORMATS]	= { "IN_FORMATS", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE },
+	[PROP_ACTIVE]		= { "ACTIVE", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_MODE_ID]		= { "MODE_ID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_ATOMIC },
+	[PROP_OUT_FENCE_PTR]	= { "OUT_FENCE_PTR", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_VRR_ENABLED]	= { "VRR_ENABLED", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_ATOMIC },
+	[PROP_VRR_CAPABLE]	= { "vrr_capable", DRM_MODE_PROP_RANGE | DRM_MODE_PROP_IMMUTABLE },
+};
+
+static const uint32_t plane_props[] = {
+	PROP_TYPE, PROP_FB_ID, PROP_CRTC_ID,
+	PROP_SRC_X, PROP_SRC_Y, PROP_SRC_W, PROP_SRC_H,
+	PROP_CRTC_X, PROP_CRTC_Y, PROP_CRTC_W, PROP_CRTC_H,
+	PROP_IN_FENCE_FD, PROP_ZPOS, PROP_IN_FORMATS,
+};
+
+static const uint32_t crtc_props[] = {
+	PROP_ACTIVE, PROP_MODE_ID, PROP_OUT_FENCE_PTR, PROP_VRR_ENABLED,
+};
+
+static const uint32_t connector_props[] = {
+	PROP_CRTC_ID, PROP_VRR_CAPABLE,
+};
+
+/* YUV last, primaries stop short of it */
+static const uint32_t plane_formats[] = {
+	DRM_FORMAT_XRGB8888,
+	DRM_FORMAT_ARGB8888,
+	DRM_FORMAT_XRGB2101010,
+	DRM_FORMAT_RGB565,
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YUV420,
+};
+#define COUNT_YUV_FORMATS	2
+
+/* room for plane_formats, keeping the modifiers that follow aligned */
+#define FORMATS_SIZE	((sizeof(plane_formats) + 7) & ~7)
+
+/* what IN_FORMATS says, on top of plane_formats, preferred first */
+static const uint64_t plane_modifiers[] = {
+	DRM_FORMAT_MOD_QCOM_COMPRESSED,
+	DRM_FORMAT_MOD_LINEAR,
+};
+
+struct fake_event {
+	uint64_t time;
+	unsigned int seq;
+	bool send;
+	void *user_data;
+	int out_fence;
+};
+
+struct fake_crtc {
+	uint64_t val[PROP_COUNT];
+	bool mode_valid;
+	drmModeModeInfo mode;
+
+	/* flips that haven't been delivered yet, oldest first */
+	struct fake_event events[MAX_EVENTS];
+	int count_events;
+	uint64_t last_flip;
+	unsigned int last_seq;
+};
+
+struct fake_plane {
+	uint64_t val[PROP_COUNT];
+	uint32_t possible_crtcs;
+};
+
+struct fake_connector {
+	uint64_t val[PROP_COUNT];
+};
+
+struct fake_blob {
+	void *data;
+	uint32_t length;
+};
+
+/* libdrm keeps its request private, so the fake one is its own thing */
+struct _drmModeAtomicReq {
+	int cursor;
+	int size;
+	struct {
+		uint32_t obj_id;
+		uint32_t prop_id;
+		uint64_t value;
+	} *items;
+};
+
+static struct {
+	int fd;
+
+	int count_crtcs;
+	int count_connectors;
+	int count_planes;
+	unsigned int hz;
+	unsigned int latency_us;
+	unsigned int probe_ms;
+	int max_planes;
+	bool boot;
+	unsigned int vrr_hz;
+	bool async;
+
+	uint64_t epoch;
+	uint64_t period;
+	uint64_t vrr_period;	/* the longest a VRR panel goes without refreshing */
+
+	struct fake_crtc crtcs[MAX_CRTCS];
+	struct fake_plane planes[MAX_PLANES];
+	struct fake_connector connectors[MAX_CONNECTORS];
+	bool fbs[MAX_FBS];
+	struct fake_blob blobs[MAX_BLOBS];
+	/* the only memory the device has, so CPU-written content is real */
+	struct {
+		uint32_t handle;
+		void *data;
+	} dumbs[MAX_DUMBS];
+	uint32_t last_handle;
+} dev = {
+	.fd = -1,
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t t)
+{
+	struct timespec ts = {
+		.tv_sec = t / 1000000000ULL,
+		.tv_nsec = t % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void *fake_calloc(size_t n, size_t size)
+{
+	void *p = calloc(n ? n : 1, size);
+
+	if (!p)
+		errno = ENOMEM;
+
+	return p;
+}
+
+/* id -> index lookups, -1 if there's no such object */
+static int crtc_idx(uint32_t id)
+{
+	int i = id - CRTC_ID_BASE;
+
+	return (id >= CRTC_ID_BASE && i < dev.count_crtcs) ? i : -1;
+}
+
+static int connector_idx(uint32_t id)
+{
+	int i = id - CONNECTOR_ID_BASE;
+
+	return (id >= CONNECTOR_ID_BASE && i < dev.count_connectors) ? i : -1;
+}
+
+static int encoder_idx(uint32_t id)
+{
+	int i = id - ENCODER_ID_BASE;
+
+	return (id >= ENCODER_ID_BASE && i < dev.count_connectors) ? i : -1;
+}
+
+static int plane_idx(uint32_t id)
+{
+	int i = id - PLANE_ID_BASE;
+
+	return (id >= PLANE_ID_BASE && i < dev.count_planes) ? i : -1;
+}
+
+static bool fb_valid(uint32_t id)
+{
+	int i = id - FB_ID_BASE;
+
+	return id >= FB_ID_BASE && i < MAX_FBS && dev.fbs[i];
+}
+
+static void fill_mode(drmModeModeInfoPtr mode, int w, int h,
+		      int htotal, int vtotal, unsigned int hz)
+{
+	memset(mode, 0, sizeof *mode);
+
+	mode->hdisplay = w;
+	mode->hsync_start = w + (htotal - w) / 4;
+	mode->hsync_end = w + (htotal - w) / 2;
+	mode->htotal = htotal;
+	mode->vdisplay = h;
+	mode->vsync_start = h + (vtotal - h) / 4;
+	mode->vsync_end = h + (vtotal - h) / 2;
+	mode->vtotal = vtotal;
+	mode->vrefresh = hz;
+	mode->clock = (uint64_t) htotal * vtotal * hz / 1000;
+	mode->type = DRM_MODE_TYPE_DRIVER;
+	mode->flags = DRM_MODE_FLAG_PHSYNC | DRM_MODE_FLAG_PVSYNC;
+
+	snprintf(mode->name, sizeof mode->name, "%dx%d", w, h);
+}
+
+static int fill_modes(drmModeModeInfoPtr modes)
+{
+	fill_mode(&modes[0], 1920, 1080, 2200, 1125, dev.hz);
+	fill_mode(&modes[1], 1280, 720, 1650, 750, dev.hz);
+	fill_mode(&modes[2], 1024, 768, 1344, 806, dev.hz);
+
+	modes[0].type |= DRM_MODE_TYPE_PREFERRED;
+
+	return 3;
+}
+
+static bool parse_spec(const char *spec)
+{
+	char *str, *tok, *save = NULL;
+	bool ok = true;
+
+	dev.count_crtcs = 2;
+	dev.count_connectors = 2;
+	dev.count_planes = 4;
+	dev.hz = 60;
+	dev.latency_us = 0;
+	dev.probe_ms = 0;
+	dev.max_planes = 0;
+
+	if (!spec || !*spec)
+		return true;
+
+	str = strdup(spec);
+	if (!str)
+		return false;
+
+	for (tok = strtok_r(str, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		char *val = strchr(tok, '=');
+		int n;
+
+		if (!val) {
+			ok = false;
+			break;
+		}
+		*val++ = '\0';
+		n = atoi(val);
+
+		if (!strcmp(tok, "crtcs"))
+			dev.count_crtcs = n;
+		else if (!strcmp(tok, "connectors"))
+			dev.count_connectors = n;
+		else if (!strcmp(tok, "planes"))
+			dev.count_planes = n;
+		else if (!strcmp(tok, "hz"))
+			dev.hz = n;
+		else if (!strcmp(tok, "latency"))
+			dev.latency_us = n;
+		else if (!strcmp(tok, "probe"))
+			dev.probe_ms = n;
+		else if (!strcmp(tok, "maxplanes"))
+			dev.max_planes = n;
+		else if (!strcmp(tok, "boot"))
+			dev.boot = n;
+		else if (!strcmp(tok, "vrr"))
+			dev.vrr_hz = n;
+		else if (!strcmp(tok, "async"))
+			dev.async = n;
+		else
+			ok = false;
+	}
+
+	free(str);
+
+	if (!ok)
+		fprintf(stderr, "bad fake device spec \"%s\"\n", spec);
+
+	return ok;
+}
+
+static int fake_create_property_blob(int fd, const void *data, size_t length,
+				     uint32_t *blob_id);
+
+/*
+ * Lights up each connector that has a CRTC of its own, in the preferred
+ * mode, showing a framebuffer that belongs to nobody.
+ */
+static void boot_displays(void)
+{
+	drmModeModeInfo modes[3];
+	int i;
+
+	fill_modes(modes);
+
+	for (i = 0; i < dev.count_crtcs && i < dev.count_connectors; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+		struct fake_plane *p = &dev.planes[i];
+		uint32_t blob;
+
+		if (fake_create_property_blob(dev.fd, &modes[0], sizeof modes[0], &blob))
+			return;
+
+		c->mode_valid = true;
+		c->mode = modes[0];
+		c->val[PROP_MODE_ID] = blob;
+		c->val[PROP_ACTIVE] = 1;
+
+		dev.fbs[i] = true;
+		p->val[PROP_FB_ID] = FB_ID_BASE + i;
+		p->val[PROP_CRTC_ID] = CRTC_ID_BASE + i;
+		p->val[PROP_SRC_W] = modes[0].hdisplay << 16;
+		p->val[PROP_SRC_H] = modes[0].vdisplay << 16;
+		p->val[PROP_CRTC_W] = modes[0].hdisplay;
+		p->val[PROP_CRTC_H] = modes[0].vdisplay;
+
+		dev.connectors[i].val[PROP_CRTC_ID] = CRTC_ID_BASE + i;
+	}
+}
+
+static int fake_open(const char *spec)
+{
+	int i;
+
+	if (dev.fd >= 0) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	memset(&dev, 0, sizeof dev);
+	dev.fd = -1;
+
+	if (!parse_spec(spec)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the primaries come on top of the overlays */
+	dev.count_planes += dev.count_crtcs;
+
+	if (dev.count_crtcs < 1 || dev.count_crtcs > MAX_CRTCS ||
+	    dev.count_connectors < 1 || dev.count_connectors > MAX_CONNECTORS ||
+	    dev.count_planes > MAX_PLANES || dev.hz < 1) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	dev.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (dev.fd < 0)
+		return -1;
+
+	dev.epoch = now_ns();
+	dev.period = 1000000000ULL / dev.hz;
+
+	if (dev.vrr_hz && dev.vrr_hz < dev.hz)
+		dev.vrr_period = 1000000000ULL / dev.vrr_hz;
+
+	for (i = 0; i < dev.count_connectors; i++)
+		dev.connectors[i].val[PROP_VRR_CAPABLE] = dev.vrr_period != 0;
+
+	for (i = 0; i < dev.count_planes; i++) {
+		struct fake_plane *p = &dev.planes[i];
+
+		if (i < dev.count_crtcs) {
+			p->val[PROP_TYPE] = DRM_PLANE_TYPE_PRIMARY;
+			p->possible_crtcs = 1u << i;
+		} else {
+			p->val[PROP_TYPE] = DRM_PLANE_TYPE_OVERLAY;
+			p->possible_crtcs = (1ULL << dev.count_crtcs) - 1;
+		}
+		p->val[PROP_IN_FENCE_FD] = -1;
+		p->val[PROP_ZPOS] = i;
+		p->val[PROP_IN_FORMATS] = BLOB_ID_BASE + i;
+	}
+
+	if (dev.boot)
+		boot_displays();
+
+	return dev.fd;
+}
+
+static int fake_close(int fd)
+{
+	int i, j;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -1;
+	}
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+
+		for (j = 0; j < c->count_events; j++) {
+			if (c->events[j].out_fence >= 0)
+				close(c->events[j].out_fence);
+		}
+	}
+
+	for (i = 0; i < MAX_BLOBS; i++) {
+		free(dev.blobs[i].data);
+		dev.blobs[i].data = NULL;
+	}
+
+	for (i = 0; i < MAX_DUMBS; i++) {
+		free(dev.dumbs[i].data);
+		dev.dumbs[i].data = NULL;
+	}
+
+	close(dev.fd);
+	dev.fd = -1;
+
+	return 0;
+}
+
+static int fake_set_client_cap(int fd, uint64_t cap, uint64_t value)
+{
+	return 0;
+}
+
+static int fake_get_cap(int fd, uint64_t cap, uint64_t *value)
+{
+	switch (cap) {
+	case DRM_CAP_TIMESTAMP_MONOTONIC:
+	case DRM_CAP_CRTC_IN_VBLANK_EVENT:
+	case DRM_CAP_ADDFB2_MODIFIERS:
+		*value = 1;
+		return 0;
+	case DRM_CAP_ASYNC_PAGE_FLIP:
+	case DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP:
+		*value = dev.async;
+		return 0;
+	default:
+		*value = 0;
+		return 0;
+	}
+}
+
+static drmModeResPtr fake_get_resources(int fd)
+{
+	drmModeResPtr res;
+	int i;
+
+	res = fake_calloc(1, sizeof *res);
+	if (!res)
+		return NULL;
+
+	res->count_crtcs = dev.count_crtcs;
+	res->count_connectors = dev.count_connectors;
+	res->count_encoders = dev.count_connectors;
+	res->crtcs = fake_calloc(dev.count_crtcs, sizeof *res->crtcs);
+	res->connectors = fake_calloc(dev.count_connectors, sizeof *res->connectors);
+	res->encoders = fake_calloc(dev.count_connectors, sizeof *res->encoders);
+	res->min_width = res->min_height = 1;
+	res->max_width = res->max_height = 8192;
+
+	if (!res->crtcs || !res->connectors || !res->encoders) {
+		drmModeFreeResources(res);
+		return NULL;
+	}
+
+	for (i = 0; i < dev.count_crtcs; i++)
+		res->crtcs[i] = CRTC_ID_BASE + i;
+	for (i = 0; i < dev.count_connectors; i++) {
+		res->connectors[i] = CONNECTOR_ID_BASE + i;
+		res->encoders[i] = ENCODER_ID_BASE + i;
+	}
+
+	return res;
+}
+
+static drmModePlaneResPtr fake_get_plane_resources(int fd)
+{
+	drmModePlaneResPtr res;
+	int i;
+
+	res = fake_calloc(1, sizeof *res);
+	if (!res)
+		return NULL;
+
+	res->planes = fake_calloc(dev.count_planes, sizeof *res->planes);
+	if (!res->planes) {
+		free(res);
+		return NULL;
+	}
+
+	res->count_planes = dev.count_planes;
+	for (i = 0; i < dev.count_planes; i++)
+		res->planes[i] = PLANE_ID_BASE + i;
+
+	return res;
+}
+
+/* every connector has exactly one encoder, with the same index */
+static drmModeConnectorPtr fake_get_connector_current(int fd, uint32_t connector_id)
+{
+	int idx = connector_idx(connector_id);
+	drmModeConnectorPtr con;
+	int i;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	con = fake_calloc(1, sizeof *con);
+	if (!con)
+		return NULL;
+
+	con->connector_id = connector_id;
+	con->connector_type = DRM_MODE_CONNECTOR_VIRTUAL;
+	con->connector_type_id = idx + 1;
+	con->connection = DRM_MODE_CONNECTED;
+	con->subpixel = DRM_MODE_SUBPIXEL_UNKNOWN;
+	con->mmWidth = 520;
+	con->mmHeight = 290;
+	if (dev.connectors[idx].val[PROP_CRTC_ID])
+		con->encoder_id = ENCODER_ID_BASE + idx;
+
+	con->modes = fake_calloc(3, sizeof *con->modes);
+	con->encoders = fake_calloc(1, sizeof *con->encoders);
+	con->props = fake_calloc(ARRAY_SIZE(connector_props), sizeof *con->props);
+	con->prop_values = fake_calloc(ARRAY_SIZE(connector_props), sizeof *con->prop_values);
+	if (!con->modes || !con->encoders || !con->props || !con->prop_values) {
+		drmModeFreeConnector(con);
+		return NULL;
+	}
+
+	con->count_modes = fill_modes(con->modes);
+	con->count_encoders = 1;
+	con->encoders[0] = ENCODER_ID_BASE + idx;
+	con->count_props = ARRAY_SIZE(connector_props);
+	for (i = 0; i < con->count_props; i++) {
+		con->props[i] = connector_props[i];
+		con->prop_values[i] = dev.connectors[idx].val[connector_props[i]];
+	}
+
+	return con;
+}
+
+/* like a DP or HDMI sink, a full probe talks to the monitor first */
+static drmModeConnectorPtr fake_get_connector(int fd, uint32_t connector_id)
+{
+	if (dev.probe_ms)
+		sleep_until(now_ns() + dev.probe_ms * 1000000ULL);
+
+	return fake_get_connector_current(fd, connector_id);
+}
+
+static drmModeEncoderPtr fake_get_encoder(int fd, uint32_t encoder_id)
+{
+	int idx = encoder_idx(encoder_id);
+	drmModeEncoderPtr enc;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	enc = fake_calloc(1, sizeof *enc);
+	if (!enc)
+		return NULL;
+
+	enc->encoder_id = encoder_id;
+	enc->encoder_type = DRM_MODE_ENCODER_VIRTUAL;
+	enc->crtc_id = dev.connectors[idx].val[PROP_CRTC_ID];
+	enc->possible_crtcs = (1ULL << dev.count_crtcs) - 1;
+
+	return enc;
+}
+
+static drmModeCrtcPtr fake_get_crtc(int fd, uint32_t crtc_id)
+{
+	int idx = crtc_idx(crtc_id);
+	drmModeCrtcPtr crtc;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	crtc = fake_calloc(1, sizeof *crtc);
+	if (!crtc)
+		return NULL;
+
+	crtc->crtc_id = crtc_id;
+	crtc->buffer_id = dev.planes[idx].val[PROP_FB_ID];
+	crtc->mode_valid = dev.crtcs[idx].mode_valid;
+	if (crtc->mode_valid) {
+		crtc->mode = dev.crtcs[idx].mode;
+		crtc->width = crtc->mode.hdisplay;
+		crtc->height = crtc->mode.vdisplay;
+	}
+
+	return crtc;
+}
+
+static int plane_count_formats(int idx)
+{
+	if (dev.planes[idx].val[PROP_TYPE] == DRM_PLANE_TYPE_PRIMARY)
+		return ARRAY_SIZE(plane_formats) - COUNT_YUV_FORMATS;
+
+	return ARRAY_SIZE(plane_formats);
+}
+
+static drmModePlanePtr fake_get_plane(int fd, uint32_t plane_id)
+{
+	int idx = plane_idx(plane_id);
+	drmModePlanePtr plane;
+
+	if (idx < 0) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	plane = fake_calloc(1, sizeof *plane);
+	if (!plane)
+		return NULL;
+
+	plane->formats = fake_calloc(ARRAY_SIZE(plane_formats), sizeof *plane->formats);
+	if (!plane->formats) {
+		free(plane);
+		return NULL;
+	}
+
+	plane->count_formats = plane_count_formats(idx);
+	memcpy(plane->formats, plane_formats, plane->count_formats * sizeof *plane->formats);
+	plane->plane_id = plane_id;
+	plane->crtc_id = dev.planes[idx].val[PROP_CRTC_ID];
+	plane->fb_id = dev.planes[idx].val[PROP_FB_ID];
+	plane->crtc_x = dev.planes[idx].val[PROP_CRTC_X];
+	plane->crtc_y = dev.planes[idx].val[PROP_CRTC_Y];
+	plane->possible_crtcs = dev.planes[idx].possible_crtcs;
+
+	return plane;
+}
+
+/* the property list and value array of an object, NULL if none */
+static uint64_t *object_props(uint32_t obj_id, uint32_t obj_type,
+			      const uint32_t **list, int *count)
+{
+	int idx;
+
+	switch (obj_type) {
+	case DRM_MODE_OBJECT_CRTC:
+		idx = crtc_idx(obj_id);
+		if (idx < 0)
+			return NULL;
+		*list = crtc_props;
+		*count = ARRAY_SIZE(crtc_props);
+		return dev.crtcs[idx].val;
+	case DRM_MODE_OBJECT_PLANE:
+		idx = plane_idx(obj_id);
+		if (idx < 0)
+			return NULL;
+		*list = plane_props;
+		*count = ARRAY_SIZE(plane_props);
+		return dev.planes[idx].val;
+	case DRM_MODE_OBJECT_CONNECTOR:
+		idx = connector_idx(obj_id);
+		if (idx < 0)
+			return NULL;
+		*list = connector_props;
+		*count = ARRAY_SIZE(connector_props);
+		return dev.connectors[idx].val;
+	default:
+		return NULL;
+	}
+}
+
+static uint32_t object_type(uint32_t obj_id)
+{
+	if (crtc_idx(obj_id) >= 0)
+		return DRM_MODE_OBJECT_CRTC;
+	if (plane_idx(obj_id) >= 0)
+		return DRM_MODE_OBJECT_PLANE;
+	if (connector_idx(obj_id) >= 0)
+		return DRM_MODE_OBJECT_CONNECTOR;
+	return 0;
+}
+
+static drmModeObjectPropertiesPtr fake_get_properties(int fd, uint32_t obj_id,
+						       uint32_t obj_type)
+{
+	drmModeObjectPropertiesPtr props;
+	const uint32_t *list;
+	uint64_t *val;
+	int i, count;
+
+	val = object_props(obj_id, obj_type, &list, &count);
+	if (!val) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	props = fake_calloc(1, sizeof *props);
+	if (!props)
+		return NULL;
+
+	props->props = fake_calloc(count, sizeof *props->props);
+	props->prop_values = fake_calloc(count, sizeof *props->prop_values);
+	if (!props->props || !props->prop_values) {
+		drmModeFreeObjectProperties(props);
+		return NULL;
+	}
+
+	props->count_props = count;
+	for (i = 0; i < count; i++) {
+		props->props[i] = list[i];
+		props->prop_values[i] = val[list[i]];
+	}
+
+	return props;
+}
+
+static drmModePropertyPtr fake_get_property(int fd, uint32_t prop_id)
+{
+	static const char *type_names[] = {
+		[DRM_PLANE_TYPE_OVERLAY] = "Overlay",
+		[DRM_PLANE_TYPE_PRIMARY] = "Primary",
+		[DRM_PLANE_TYPE_CURSOR] = "Cursor",
+	};
+	drmModePropertyPtr prop;
+	int i;
+
+	if (prop_id <= PROP_NONE || prop_id >= PROP_COUNT) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	prop = fake_calloc(1, sizeof *prop);
+	if (!prop)
+		return NULL;
+
+	prop->prop_id = prop_id;
+	prop->flags = props[prop_id].flags;
+	snprintf(prop->name, sizeof prop->name, "%s", props[prop_id].name);
+
+	if (prop_id == PROP_ZPOS) {
+		prop->values = fake_calloc(2, sizeof *prop->values);
+		if (!prop->values) {
+			drmModeFreeProperty(prop);
+			return NULL;
+		}
+		prop->count_values = 2;
+		prop->values[0] = 0;
+		prop->values[1] = dev.count_planes - 1;
+	}
+
+	if (prop_id == PROP_TYPE) {
+		prop->enums = fake_calloc(ARRAY_SIZE(type_names), sizeof *prop->enums);
+		if (!prop->enums) {
+			drmModeFreeProperty(prop);
+			return NULL;
+		}
+		prop->count_enums = ARRAY_SIZE(type_names);
+		for (i = 0; i < prop->count_enums; i++) {
+			prop->enums[i].value = i;
+			snprintf(prop->enums[i].name, sizeof prop->enums[i].name,
+				 "%s", type_names[i]);
+		}
+	}
+
+	return prop;
+}
+
+static const struct fake_blob *find_blob(uint32_t blob_id)
+{
+	uint32_t i = blob_id - USER_BLOB_ID_BASE;
+
+	if (blob_id < USER_BLOB_ID_BASE || i >= MAX_BLOBS || !dev.blobs[i].data)
+		return NULL;
+
+	return &dev.blobs[i];
+}
+
+static drmModePropertyBlobPtr user_blob(uint32_t blob_id)
+{
+	const struct fake_blob *b = find_blob(blob_id);
+	drmModePropertyBlobPtr blob;
+
+	if (!b) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	blob = fake_calloc(1, sizeof *blob);
+	if (!blob)
+		return NULL;
+
+	blob->data = fake_calloc(1, b->length);
+	if (!blob->data) {
+		free(blob);
+		return NULL;
+	}
+
+	blob->id = blob_id;
+	blob->length = b->length;
+	memcpy(blob->data, b->data, b->length);
+
+	return blob;
+}
+
+/* the planes' IN_FORMATS, and whatever userspace created */
+static drmModePropertyBlobPtr fake_get_property_blob(int fd, uint32_t blob_id)
+{
+	struct drm_format_modifier_blob *hdr;
+	struct drm_format_modifier *mods;
+	drmModePropertyBlobPtr blob;
+	uint32_t size;
+	int i;
+
+	if (blob_id >= USER_BLOB_ID_BASE)
+		return user_blob(blob_id);
+
+	if (blob_id < BLOB_ID_BASE || blob_id - BLOB_ID_BASE >= (uint32_t) dev.count_planes) {
+		errno = ENOENT;
+		return NULL;
+	}
+
+	size = sizeof *hdr + FORMATS_SIZE +
+		ARRAY_SIZE(plane_modifiers) * sizeof *mods;
+
+	blob = fake_calloc(1, sizeof *blob);
+	if (!blob)
+		return NULL;
+
+	blob->data = fake_calloc(1, size);
+	if (!blob->data) {
+		free(blob);
+		return NULL;
+	}
+
+	blob->id = blob_id;
+	blob->length = size;
+
+	hdr = blob->data;
+	hdr->version = 1;
+	hdr->count_formats = plane_count_formats(blob_id - BLOB_ID_BASE);
+	hdr->formats_offset = sizeof *hdr;
+	hdr->count_modifiers = ARRAY_SIZE(plane_modifiers);
+	hdr->modifiers_offset = sizeof *hdr + FORMATS_SIZE;
+
+	memcpy((char *) hdr + hdr->formats_offset, plane_formats,
+	       hdr->count_formats * sizeof *plane_formats);
+
+	mods = (struct drm_format_modifier *) ((char *) hdr + hdr->modifiers_offset);
+	for (i = 0; i < ARRAY_SIZE(plane_modifiers); i++) {
+		mods[i].formats = (1ULL << hdr->count_formats) - 1;
+		mods[i].offset = 0;
+		mods[i].modifier = plane_modifiers[i];
+	}
+
+	return blob;
+}
+
+static int fake_create_property_blob(int fd, const void *data, size_t length,
+				     uint32_t *blob_id)
+{
+	int i;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	if (!length) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	for (i = 0; i < MAX_BLOBS; i++) {
+		if (!dev.blobs[i].data)
+			break;
+	}
+
+	if (i == MAX_BLOBS) {
+		errno = ENOSPC;
+		return -ENOSPC;
+	}
+
+	dev.blobs[i].data = malloc(length);
+	if (!dev.blobs[i].data) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+
+	memcpy(dev.blobs[i].data, data, length);
+	dev.blobs[i].length = length;
+	*blob_id = USER_BLOB_ID_BASE + i;
+
+	return 0;
+}
+
+/* like the kernel, a CRTC using the blob keeps its own copy of the mode */
+static int fake_destroy_property_blob(int fd, uint32_t blob_id)
+{
+	struct fake_blob *b = (struct fake_blob *) find_blob(blob_id);
+
+	if (!b) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	free(b->data);
+	b->data = NULL;
+	b->length = 0;
+
+	return 0;
+}
+
+/* the mode in a MODE_ID blob, or NULL if it isn't one */
+static const drmModeModeInfo *blob_mode(uint64_t blob_id)
+{
+	const struct fake_blob *b = find_blob(blob_id);
+
+	if (!b || b->length != sizeof(drmModeModeInfo))
+		return NULL;
+
+	return b->data;
+}
+
+static int fake_add_fb2(int fd, uint32_t width, uint32_t height, uint32_t fmt,
+			const uint32_t handles[4], const uint32_t pitches[4],
+			const uint32_t offsets[4], uint32_t *fb_id, uint32_t flags)
+{
+	int count_planes;
+	int i;
+
+	switch (fmt) {
+	case DRM_FORMAT_NV12:
+		count_planes = 2;
+		break;
+	case DRM_FORMAT_YUV420:
+		count_planes = 3;
+		break;
+	default:
+		count_planes = 1;
+		break;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(plane_formats); i++) {
+		if (plane_formats[i] == fmt)
+			break;
+	}
+
+	if (!width || !height || i == ARRAY_SIZE(plane_formats)) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count_planes; i++) {
+		if (!handles[i] || !pitches[i]) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < MAX_FBS; i++) {
+		if (dev.fbs[i])
+			continue;
+
+		dev.fbs[i] = true;
+		*fb_id = FB_ID_BASE + i;
+		return 0;
+	}
+
+	errno = ENOSPC;
+	return -ENOSPC;
+}
+
+/*
+ * Every plane takes the same layouts, so a modifier is good if
+ * IN_FORMATS lists it at all.  All of a buffer's planes share one.
+ */
+static int fake_add_fb2_with_modifiers(int fd, uint32_t width, uint32_t height, uint32_t fmt,
+				       const uint32_t handles[4], const uint32_t pitches[4],
+				       const uint32_t offsets[4], const uint64_t modifiers[4],
+				       uint32_t *fb_id, uint32_t flags)
+{
+	int i;
+
+	if (!(flags & DRM_MODE_FB_MODIFIERS))
+		return fake_add_fb2(fd, width, height, fmt, handles, pitches, offsets, fb_id, flags);
+
+	for (i = 1; i < 4; i++) {
+		if (handles[i] && modifiers[i] != modifiers[0]) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < ARRAY_SIZE(plane_modifiers); i++) {
+		if (plane_modifiers[i] == modifiers[0])
+			return fake_add_fb2(fd, width, height, fmt, handles, pitches, offsets,
+					    fb_id, flags & ~DRM_MODE_FB_MODIFIERS);
+	}
+
+	errno = EINVAL;
+	return -EINVAL;
+}
+
+/* nothing is backed by memory, so any dma-buf gets a fresh handle */
+static int fake_prime_fd_to_handle(int fd, int prime_fd, uint32_t *handle)
+{
+	if (prime_fd < 0) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	*handle = ++dev.last_handle;
+
+	return 0;
+}
+
+static int fake_close_handle(int fd, uint32_t handle)
+{
+	return 0;
+}
+
+static int find_dumb(uint32_t handle)
+{
+	int i;
+
+	for (i = 0; i < MAX_DUMBS; i++) {
+		if (dev.dumbs[i].data && dev.dumbs[i].handle == handle)
+			return i;
+	}
+
+	return -1;
+}
+
+static int fake_create_dumb(int fd, uint32_t width, uint32_t height, uint32_t bpp,
+			    uint32_t *handle, uint32_t *pitch, uint64_t *size)
+{
+	int i;
+
+	if (!width || !height || !bpp || bpp % 8) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	for (i = 0; i < MAX_DUMBS; i++) {
+		if (!dev.dumbs[i].data)
+			break;
+	}
+	if (i == MAX_DUMBS) {
+		errno = ENOSPC;
+		return -ENOSPC;
+	}
+
+	/* what most hardware wants of a scanout pitch */
+	*pitch = (width * bpp / 8 + 63) & ~63;
+	*size = (uint64_t) *pitch * height;
+
+	dev.dumbs[i].data = fake_calloc(1, *size);
+	if (!dev.dumbs[i].data) {
+		errno = ENOMEM;
+		return -ENOMEM;
+	}
+
+	dev.dumbs[i].handle = ++dev.last_handle;
+	*handle = dev.dumbs[i].handle;
+
+	return 0;
+}
+
+static void *fake_map_dumb(int fd, uint32_t handle, uint64_t size)
+{
+	int i = find_dumb(handle);
+
+	return i < 0 ? NULL : dev.dumbs[i].data;
+}
+
+static void fake_unmap_dumb(void *map, uint64_t size)
+{
+}
+
+static int fake_destroy_dumb(int fd, uint32_t handle)
+{
+	int i = find_dumb(handle);
+
+	if (i < 0) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	free(dev.dumbs[i].data);
+	dev.dumbs[i].data = NULL;
+
+	return 0;
+}
+
+static int fake_rm_fb(int fd, uint32_t fb_id)
+{
+	if (!fb_valid(fb_id)) {
+		errno = ENOENT;
+		return -ENOENT;
+	}
+
+	dev.fbs[fb_id - FB_ID_BASE] = false;
+
+	return 0;
+}
+
+/* CRTC index a plane or connector ends up on, or -1 */
+static int value_crtc(uint64_t crtc_id)
+{
+	return crtc_id ? crtc_idx(crtc_id) : -1;
+}
+
+static void arm_timer(void)
+{
+	struct itimerspec its = {};
+	uint64_t next = 0;
+	int i;
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+
+		if (c->count_events && (!next || c->events[0].time < next))
+			next = c->events[0].time;
+	}
+
+	its.it_value.tv_sec = next / 1000000000ULL;
+	its.it_value.tv_nsec = next % 1000000000ULL;
+
+	timerfd_settime(dev.fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+static int fake_set_crtc(int fd, uint32_t crtc_id, uint32_t fb_id,
+			 uint32_t x, uint32_t y, uint32_t *connectors, int count,
+			 drmModeModeInfoPtr mode)
+{
+	int idx = crtc_idx(crtc_id);
+	struct fake_crtc *c;
+	struct fake_plane *primary;
+	int i;
+
+	if (idx < 0 || (fb_id && !fb_valid(fb_id))) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (connector_idx(connectors[i]) < 0) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+	}
+
+	c = &dev.crtcs[idx];
+	primary = &dev.planes[idx];
+
+	for (i = 0; i < dev.count_connectors; i++) {
+		if (dev.connectors[i].val[PROP_CRTC_ID] == crtc_id)
+			dev.connectors[i].val[PROP_CRTC_ID] = 0;
+	}
+
+	if (!mode || !fb_id) {
+		c->mode_valid = false;
+		c->val[PROP_ACTIVE] = 0;
+		primary->val[PROP_FB_ID] = 0;
+		primary->val[PROP_CRTC_ID] = 0;
+		return 0;
+	}
+
+	c->mode_valid = true;
+	c->mode = *mode;
+	c->val[PROP_ACTIVE] = 1;
+
+	primary->val[PROP_FB_ID] = fb_id;
+	primary->val[PROP_CRTC_ID] = crtc_id;
+	primary->val[PROP_SRC_X] = x << 16;
+	primary->val[PROP_SRC_Y] = y << 16;
+	primary->val[PROP_SRC_W] = mode->hdisplay << 16;
+	primary->val[PROP_SRC_H] = mode->vdisplay << 16;
+	primary->val[PROP_CRTC_X] = 0;
+	primary->val[PROP_CRTC_Y] = 0;
+	primary->val[PROP_CRTC_W] = mode->hdisplay;
+	primary->val[PROP_CRTC_H] = mode->vdisplay;
+
+	for (i = 0; i < count; i++)
+		dev.connectors[connector_idx(connectors[i])].val[PROP_CRTC_ID] = crtc_id;
+
+	/* a modeset takes a frame */
+	sleep_until(now_ns() + dev.period);
+
+	return 0;
+}
+
+/*
+ * Books the refresh that an update made at 'now' on CRTC idx lands on,
+ * or for an async one, when it starts scanning out mid-frame.
+ */
+static uint64_t book_vblank(int idx, uint64_t now, bool async)
+{
+	struct fake_crtc *c = &dev.crtcs[idx];
+	uint64_t vblank;
+	unsigned int seq;
+
+	if (async) {
+		vblank = max(now, c->last_flip);
+		seq = (vblank - dev.epoch) / dev.period;
+	} else if (c->val[PROP_VRR_ENABLED] && dev.vrr_period) {
+		/*
+		 * The panel refreshes as soon as there's something
+		 * new, but no faster than hz=, and on its own every
+		 * vrr_period while there isn't.
+		 */
+		vblank = max(now, c->last_flip + dev.period);
+		seq = c->last_seq + 1;
+		if (c->last_flip && vblank - c->last_flip > dev.vrr_period)
+			seq += (vblank - c->last_flip - 1) / dev.vrr_period;
+	} else {
+		/* everything lands on the next vblank after the commit: */
+		seq = (now - dev.epoch) / dev.period + 1;
+		vblank = dev.epoch + seq * dev.period;
+
+		/* a blocking commit waits for the previous flip first */
+		if (c->last_flip > vblank) {
+			seq = (c->last_flip - dev.epoch) / dev.period + 1;
+			vblank = dev.epoch + seq * dev.period;
+		}
+	}
+
+	c->last_flip = vblank;
+	c->last_seq = seq;
+
+	return vblank;
+}
+
+/*
+ * Books the refresh for a flip on CRTC idx, and queues its event.  The
+ * caller checked there's room for one.
+ */
+static struct fake_event *queue_flip(int idx, uint64_t now, uint32_t flags,
+				     void *user_data)
+{
+	struct fake_crtc *c = &dev.crtcs[idx];
+	struct fake_event *e;
+	uint64_t vblank = book_vblank(idx, now, flags & DRM_MODE_PAGE_FLIP_ASYNC);
+
+	e = &c->events[c->count_events++];
+	memset(e, 0, sizeof *e);
+	e->time = vblank;
+	e->seq = c->last_seq;
+	e->out_fence = -1;
+	e->send = flags & DRM_MODE_PAGE_FLIP_EVENT;
+	e->user_data = user_data;
+
+	return e;
+}
+
+/*
+ * Legacy SetPlane is a blocking update in the atomic helpers, so this
+ * one waits for the refresh that shows it too.
+ */
+static int fake_set_plane(int fd, uint32_t plane_id, uint32_t crtc_id,
+			  uint32_t fb_id, uint32_t flags,
+			  int32_t crtc_x, int32_t crtc_y,
+			  uint32_t crtc_w, uint32_t crtc_h,
+			  uint32_t src_x, uint32_t src_y,
+			  uint32_t src_w, uint32_t src_h)
+{
+	int idx = plane_idx(plane_id);
+	int c = crtc_idx(crtc_id);
+	struct fake_plane *p;
+	uint64_t now;
+	int i, active = 1;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	if (idx < 0 || (fb_id && (c < 0 || !fb_valid(fb_id) ||
+				  !(dev.planes[idx].possible_crtcs & (1u << c)) ||
+				  !dev.crtcs[c].mode_valid))) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	p = &dev.planes[idx];
+
+	if (fb_id) {
+		for (i = 0; i < dev.count_planes; i++) {
+			if (i != idx && dev.planes[i].val[PROP_FB_ID] &&
+			    dev.planes[i].val[PROP_CRTC_ID] == crtc_id)
+				active++;
+		}
+		if (active > dev.max_planes && dev.max_planes) {
+			errno = EINVAL;
+			return -EINVAL;
+		}
+	} else {
+		/* disabling, the CRTC that counts is the one it was on */
+		c = value_crtc(p->val[PROP_CRTC_ID]);
+	}
+
+	now = now_ns();
+
+	p->val[PROP_FB_ID] = fb_id;
+	p->val[PROP_CRTC_ID] = fb_id ? crtc_id : 0;
+	p->val[PROP_CRTC_X] = crtc_x;
+	p->val[PROP_CRTC_Y] = crtc_y;
+	p->val[PROP_CRTC_W] = crtc_w;
+	p->val[PROP_CRTC_H] = crtc_h;
+	p->val[PROP_SRC_X] = src_x;
+	p->val[PROP_SRC_Y] = src_y;
+	p->val[PROP_SRC_W] = src_w;
+	p->val[PROP_SRC_H] = src_h;
+
+	if (dev.latency_us)
+		sleep_until(now + dev.latency_us * 1000ULL);
+
+	if (c < 0 || !dev.crtcs[c].mode_valid)
+		return 0;
+
+	sleep_until(book_vblank(c, now_ns(), false));
+
+	return 0;
+}
+
+static int fake_page_flip(int fd, uint32_t crtc_id, uint32_t fb_id,
+			  uint32_t flags, void *user_data)
+{
+	int idx = crtc_idx(crtc_id);
+	struct fake_crtc *c;
+	uint64_t now;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	if (idx < 0 || !fb_valid(fb_id) || !dev.crtcs[idx].mode_valid ||
+	    ((flags & DRM_MODE_PAGE_FLIP_ASYNC) && !dev.async)) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	c = &dev.crtcs[idx];
+	now = now_ns();
+
+	/* only one flip can be pending */
+	if (c->last_flip > now || c->count_events == MAX_EVENTS) {
+		errno = EBUSY;
+		return -EBUSY;
+	}
+
+	dev.planes[idx].val[PROP_FB_ID] = fb_id;
+
+	if (dev.latency_us)
+		sleep_until(now + dev.latency_us * 1000ULL);
+
+	queue_flip(idx, now_ns(), flags, user_data);
+	arm_timer();
+
+	return 0;
+}
+
+static drmModeAtomicReqPtr fake_atomic_alloc(void)
+{
+	return fake_calloc(1, sizeof(struct _drmModeAtomicReq));
+}
+
+static void fake_atomic_free(drmModeAtomicReqPtr req)
+{
+	if (!req)
+		return;
+
+	free(req->items);
+	free(req);
+}
+
+static int fake_atomic_add_property(drmModeAtomicReqPtr req, uint32_t obj_id,
+				    uint32_t prop_id, uint64_t value)
+{
+	if (req->cursor == req->size) {
+		int size = req->size ? req->size * 2 : 16;
+		void *items = realloc(req->items, size * sizeof *req->items);
+
+		if (!items) {
+			errno = ENOMEM;
+			return -ENOMEM;
+		}
+		req->items = items;
+		req->size = size;
+	}
+
+	req->items[req->cursor].obj_id = obj_id;
+	req->items[req->cursor].prop_id = prop_id;
+	req->items[req->cursor].value = value;
+
+	return ++req->cursor;
+}
+
+static int fake_atomic_get_cursor(drmModeAtomicReqPtr req)
+{
+	return req->cursor;
+}
+
+static void fake_atomic_set_cursor(drmModeAtomicReqPtr req, int cursor)
+{
+	req->cursor = cursor;
+}
+
+static bool prop_on_object(uint32_t prop_id, uint32_t obj_type)
+{
+	const uint32_t *list;
+	int i, count;
+
+	switch (obj_type) {
+	case DRM_MODE_OBJECT_CRTC:
+		list = crtc_props;
+		count = ARRAY_SIZE(crtc_props);
+		break;
+	case DRM_MODE_OBJECT_PLANE:
+		list = plane_props;
+		count = ARRAY_SIZE(plane_props);
+		break;
+	case DRM_MODE_OBJECT_CONNECTOR:
+		list = connector_props;
+		count = ARRAY_SIZE(connector_props);
+		break;
+	default:
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (list[i] == prop_id)
+			return !(props[prop_id].flags & DRM_MODE_PROP_IMMUTABLE);
+	}
+
+	return false;
+}
+
+/*
+ * Checks a request against the state it would leave behind, and works
+ * out which CRTCs it touches and which of those need a full modeset.
+ */
+static int check_request(drmModeAtomicReqPtr req, uint32_t flags,
+			 uint32_t *crtc_mask, uint32_t *modeset_mask)
+{
+	uint64_t plane_crtc[MAX_PLANES];
+	uint64_t plane_fb[MAX_PLANES];
+	uint64_t crtc_active[MAX_CRTCS];
+	uint64_t crtc_mode[MAX_CRTCS];
+	int active[MAX_CRTCS] = {};
+	int i, c;
+
+	for (i = 0; i < dev.count_planes; i++) {
+		plane_crtc[i] = dev.planes[i].val[PROP_CRTC_ID];
+		plane_fb[i] = dev.planes[i].val[PROP_FB_ID];
+	}
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		crtc_active[i] = dev.crtcs[i].val[PROP_ACTIVE];
+		crtc_mode[i] = dev.crtcs[i].val[PROP_MODE_ID];
+	}
+
+	*modeset_mask = 0;
+
+	for (i = 0; i < req->cursor; i++) {
+		uint32_t obj = req->items[i].obj_id;
+		uint32_t prop = req->items[i].prop_id;
+		uint64_t val = req->items[i].value;
+		uint32_t type = object_type(obj);
+
+		if (!type || prop >= PROP_COUNT || !prop_on_object(prop, type) ||
+		    (props[prop].flags & DRM_MODE_PROP_IMMUTABLE))
+			return -EINVAL;
+
+		switch (prop) {
+		case PROP_FB_ID:
+			if (val && !fb_valid(val))
+				return -EINVAL;
+			if (type == DRM_MODE_OBJECT_PLANE)
+				plane_fb[plane_idx(obj)] = val;
+			break;
+		case PROP_CRTC_ID:
+			if (val && crtc_idx(val) < 0)
+				return -EINVAL;
+			if (type == DRM_MODE_OBJECT_PLANE) {
+				plane_crtc[plane_idx(obj)] = val;
+			} else if (val != dev.connectors[connector_idx(obj)].val[PROP_CRTC_ID]) {
+				/* both the CRTC it leaves and the one it goes to */
+				c = value_crtc(dev.connectors[connector_idx(obj)].val[PROP_CRTC_ID]);
+				if (c >= 0)
+					*modeset_mask |= 1u << c;
+				if (val)
+					*modeset_mask |= 1u << crtc_idx(val);
+			}
+			break;
+		case PROP_MODE_ID:
+			if (val && !blob_mode(val))
+				return -EINVAL;
+			crtc_mode[crtc_idx(obj)] = val;
+			if (val != dev.crtcs[crtc_idx(obj)].val[PROP_MODE_ID])
+				*modeset_mask |= 1u << crtc_idx(obj);
+			break;
+		case PROP_ACTIVE:
+			if (val > 1)
+				return -EINVAL;
+			crtc_active[crtc_idx(obj)] = val;
+			if (val != dev.crtcs[crtc_idx(obj)].val[PROP_ACTIVE])
+				*modeset_mask |= 1u << crtc_idx(obj);
+			break;
+		case PROP_VRR_ENABLED:
+			if (val > 1)
+				return -EINVAL;
+			break;
+		case PROP_ZPOS:
+			if (val >= (uint64_t) dev.count_planes)
+				return -EINVAL;
+			break;
+		}
+	}
+
+	*crtc_mask = 0;
+
+	for (i = 0; i < req->cursor; i++) {
+		uint32_t obj = req->items[i].obj_id;
+		uint32_t type = object_type(obj);
+		int idx;
+
+		switch (type) {
+		case DRM_MODE_OBJECT_CRTC:
+			*crtc_mask |= 1u << crtc_idx(obj);
+			break;
+		case DRM_MODE_OBJECT_PLANE:
+			idx = plane_idx(obj);
+			if (value_crtc(dev.planes[idx].val[PROP_CRTC_ID]) >= 0)
+				*crtc_mask |= 1u << value_crtc(dev.planes[idx].val[PROP_CRTC_ID]);
+			if (value_crtc(plane_crtc[idx]) >= 0) {
+				if (!(dev.planes[idx].possible_crtcs & (1u << value_crtc(plane_crtc[idx]))))
+					return -EINVAL;
+				*crtc_mask |= 1u << value_crtc(plane_crtc[idx]);
+			}
+			break;
+		case DRM_MODE_OBJECT_CONNECTOR:
+			idx = connector_idx(obj);
+			if (value_crtc(dev.connectors[idx].val[PROP_CRTC_ID]) >= 0)
+				*crtc_mask |= 1u << value_crtc(dev.connectors[idx].val[PROP_CRTC_ID]);
+			if (req->items[i].prop_id == PROP_CRTC_ID &&
+			    value_crtc(req->items[i].value) >= 0)
+				*crtc_mask |= 1u << value_crtc(req->items[i].value);
+			break;
+		}
+	}
+
+	if (*modeset_mask && !(flags & DRM_MODE_ATOMIC_ALLOW_MODESET))
+		return -EINVAL;
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		if (crtc_active[i] && !crtc_mode[i] && (*modeset_mask & (1u << i)))
+			return -EINVAL;
+	}
+
+	for (i = 0; i < dev.count_planes; i++) {
+		c = value_crtc(plane_crtc[i]);
+
+		if (c < 0 || !plane_fb[i])
+			continue;
+
+		/* nothing scans out of a CRTC that's off */
+		if (!crtc_active[c] && (*modeset_mask & (1u << c)))
+			return -EINVAL;
+
+		if (++active[c] > dev.max_planes && dev.max_planes)
+			return -EINVAL;
+	}
+
+	*crtc_mask |= *modeset_mask;
+
+	/*
+	 * Like the kernel, a tearing flip may only change the primary
+	 * planes' FB_ID, anything else has to keep its current value.
+	 */
+	if (flags & DRM_MODE_PAGE_FLIP_ASYNC) {
+		if (!dev.async || *modeset_mask)
+			return -EINVAL;
+
+		for (i = 0; i < req->cursor; i++) {
+			uint32_t obj = req->items[i].obj_id;
+			uint32_t prop = req->items[i].prop_id;
+			uint32_t type = object_type(obj);
+			const uint32_t *list;
+			int count;
+
+			if (prop == PROP_OUT_FENCE_PTR || prop == PROP_IN_FENCE_FD)
+				continue;
+			if (prop == PROP_FB_ID && plane_idx(obj) < dev.count_crtcs)
+				continue;
+			if (object_props(obj, type, &list, &count)[prop] != req->items[i].value)
+				return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+static int fake_atomic_commit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+			      void *user_data)
+{
+	uint32_t crtc_mask, modeset_mask;
+	uint64_t now, last;
+	int i, r;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	r = check_request(req, flags, &crtc_mask, &modeset_mask);
+	if (r) {
+		errno = -r;
+		return r;
+	}
+
+	now = now_ns();
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		/* the previous flip hasn't happened yet: */
+		if (c->last_flip > now && (flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+			errno = EBUSY;
+			return -EBUSY;
+		}
+
+		if (c->count_events == MAX_EVENTS) {
+			errno = EBUSY;
+			return -EBUSY;
+		}
+	}
+
+	if (flags & DRM_MODE_ATOMIC_TEST_ONLY)
+		return 0;
+
+	for (i = 0; i < req->cursor; i++) {
+		uint32_t obj = req->items[i].obj_id;
+		uint32_t prop = req->items[i].prop_id;
+		const uint32_t *list;
+		uint64_t *val;
+		int count;
+
+		/* OUT_FENCE_PTR is handled below, IN_FENCE_FD isn't waited on */
+		if (prop == PROP_OUT_FENCE_PTR || prop == PROP_IN_FENCE_FD)
+			continue;
+
+		val = object_props(obj, object_type(obj), &list, &count);
+		val[prop] = req->items[i].value;
+	}
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+		const drmModeModeInfo *mode = blob_mode(c->val[PROP_MODE_ID]);
+
+		if (!(modeset_mask & (1u << i)))
+			continue;
+
+		c->mode_valid = c->val[PROP_ACTIVE] && mode;
+		if (c->mode_valid)
+			c->mode = *mode;
+	}
+
+	/* a modeset takes a frame, however many CRTCs it covers */
+	if (modeset_mask)
+		sleep_until(now_ns() + dev.period);
+
+	if (dev.latency_us)
+		sleep_until(now + dev.latency_us * 1000ULL);
+
+	now = now_ns();
+	last = now;
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_event *e;
+		int j;
+
+		if (!(crtc_mask & (1u << i)))
+			continue;
+
+		e = queue_flip(i, now, flags, user_data);
+		last = max(last, e->time);
+
+		for (j = 0; j < req->cursor; j++) {
+			int32_t *ptr;
+
+			if (req->items[j].obj_id != CRTC_ID_BASE + (uint32_t) i ||
+			    req->items[j].prop_id != PROP_OUT_FENCE_PTR ||
+			    !req->items[j].value)
+				continue;
+
+			/*
+			 * Userspace may close its end early, so keep our
+			 * own reference to signal.
+			 */
+			ptr = (int32_t *) (uintptr_t) req->items[j].value;
+			e->out_fence = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			*ptr = e->out_fence >= 0 ? dup(e->out_fence) : -1;
+		}
+	}
+
+	arm_timer();
+
+	if (!(flags & DRM_MODE_ATOMIC_NONBLOCK))
+		sleep_until(last);
+
+	return 0;
+}
+
+static int fake_handle_event(int fd, drmEventContextPtr evctx)
+{
+	uint64_t expirations;
+	uint64_t now;
+	int i;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -1;
+	}
+
+	if (read(dev.fd, &expirations, sizeof expirations) < 0 && errno != EAGAIN)
+		return -1;
+
+	now = now_ns();
+
+	for (i = 0; i < dev.count_crtcs; i++) {
+		struct fake_crtc *c = &dev.crtcs[i];
+
+		while (c->count_events && c->events[0].time <= now) {
+			struct fake_event e = c->events[0];
+
+			c->count_events--;
+			memmove(&c->events[0], &c->events[1],
+				c->count_events * sizeof c->events[0]);
+
+			if (e.out_fence >= 0) {
+				uint64_t one = 1;
+
+				if (write(e.out_fence, &one, sizeof one) < 0)
+					perror("fake out fence");
+				close(e.out_fence);
+			}
+
+			if (!e.send)
+				continue;
+
+			if (evctx->version >= 3 && evctx->page_flip_handler2)
+				evctx->page_flip_handler2(fd, e.seq,
+							  e.time / 1000000000ULL,
+							  (e.time % 1000000000ULL) / 1000,
+							  CRTC_ID_BASE + i, e.user_data);
+			else if (evctx->page_flip_handler)
+				evctx->page_flip_handler(fd, e.seq,
+							 e.time / 1000000000ULL,
+							 (e.time % 1000000000ULL) / 1000,
+							 e.user_data);
+		}
+	}
+
+	arm_timer();
+
+	return 0;
+}
+
+/* counts the same refreshes book_vblank() does */
+static int fake_get_sequence(int fd, uint32_t crtc_id, uint64_t *seq, uint64_t *ns)
+{
+	int idx = crtc_idx(crtc_id);
+	struct fake_crtc *c;
+	uint64_t now;
+
+	if (fd != dev.fd) {
+		errno = EBADF;
+		return -EBADF;
+	}
+
+	if (idx < 0 || !dev.crtcs[idx].mode_valid) {
+		errno = EINVAL;
+		return -EINVAL;
+	}
+
+	c = &dev.crtcs[idx];
+	now = now_ns();
+
+	if (c->val[PROP_VRR_ENABLED] && dev.vrr_period) {
+		/* a pending flip's refresh hasn't started yet */
+		if (c->last_flip > now) {
+			*seq = c->last_seq - 1;
+			*ns = c->last_flip - dev.period;
+		} else {
+			*seq = c->last_seq + (now - c->last_flip) / dev.vrr_period;
+			*ns = c->last_flip + (*seq - c->last_seq) * dev.vrr_period;
+		}
+	} else {
+		*seq = (now - dev.epoch) / dev.period;
+		*ns = dev.epoch + *seq * dev.period;
+	}
+
+	return 0;
+}
+
+const struct kms_backend kms_fake = {
+	.name = "fake",
+
+	.open = fake_open,
+	.close = fake_close,
+	.set_client_cap = fake_set_client_cap,
+	.get_cap = fake_get_cap,
+
+	.get_resources = fake_get_resources,
+	.get_plane_resources = fake_get_plane_resources,
+	.get_connector = fake_get_connector,
+	.get_connector_current = fake_get_connector_current,
+	.get_encoder = fake_get_encoder,
+	.get_crtc = fake_get_crtc,
+	.get_plane = fake_get_plane,
+
+	.get_properties = fake_get_properties,
+	.get_property = fake_get_property,
+	.get_property_blob = fake_get_property_blob,
+	.create_property_blob = fake_create_property_blob,
+	.destroy_property_blob = fake_destroy_property_blob,
+
+	.add_fb2 = fake_add_fb2,
+	.add_fb2_with_modifiers = fake_add_fb2_with_modifiers,
+	.rm_fb = fake_rm_fb,
+
+	.prime_fd_to_handle = fake_prime_fd_to_handle,
+	.close_handle = fake_close_handle,
+
+	.create_dumb = fake_create_dumb,
+	.map_dumb = fake_map_dumb,
+	.unmap_dumb = fake_unmap_dumb,
+	.destroy_dumb = fake_destroy_dumb,
+
+	.set_crtc = fake_set_crtc,
+	.set_plane = fake_set_plane,
+	.page_flip = fake_page_flip,
+
+	.atomic_alloc = fake_atomic_alloc,
+	.atomic_free = fake_atomic_free,
+	.atomic_add_property = fake_atomic_add_property,
+	.atomic_get_cursor = fake_atomic_get_cursor,
+	.atomic_set_cursor = fake_atomic_set_cursor,
+	.atomic_commit = fake_atomic_commit,
+
+	.handle_event = fake_handle_event,
+	.get_sequence = fake_get_sequence,
+};
@@ -41,24 +41,35 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 #include <gbm.h>
 
+#include "device.h"
+#include "kms.h"
 #include "utils.h"
 #include "gutils.h"
 #include "term.h"
 #include "common.h"
 #include "gl.h"
+#include "stats.h"
+#include "video.h"
 
-#define dprintf printf
-//#define dprintf(x...) do {} while (0)
+//#define dprintf printf
+#define dprintf(x...) do {} while (0)
+
+#define ARRAY_SIZE(a) ((int)(sizeof(a)/sizeof((a)[0])))
 
 #define min(a,b) ((a) < (b) ? (a) : (b))
 #define max(a,b) ((a) > (b) ? (a) : (b))
 
+/* most layouts we'll offer the allocator for one plane */
+#define MAX_MODIFIERS 16
+
 static enum {
 	ANIM_CURVE,
 	ANIM_RAND,
@@ -66,6 +77,12 @@ static enum {
 	ANIM_COUNT,
 } anim_mode = ANIM_RAND;
 
+static const char *anim_names[] = {
+	[ANIM_CURVE] = "curve",
+	[ANIM_RAND] = "rand",
+	[ANIM_STATIC] = "static",
+};
+
 static bool anim_clear;
 
 struct region {
@@ -82,23 +99,106 @@ struct my_crtc {
 
 	bool dirty_mode;
 
+	/*
+	 * With VRR_ENABLED the panel scans out each frame as soon as it
+	 * is committed, within its range, instead of on the mode's grid.
+	 */
+	bool vrr_capable;
+	bool vrr;
+	bool dirty_vrr;
+	/* VRR: nothing new to show last time round, so nothing was presented */
+	bool idle;
+
 	unsigned int dispw;
 	unsigned int disph;
 
+	/* what was on screen before us, to go back to on exit */
 	drmModeModeInfo original_mode;
+	uint32_t original_fb;
+	struct region original_src;
+	struct region original_dst;
+
 	drmModeModeInfo mode;
 
 	unsigned int frames;
-	struct timespec prev;
+	uint64_t prev;
+
+	/* when the overlays were last moved */
+	uint64_t anim_time;
+
+	/* everything in nanoseconds */
+	struct {
+		struct histogram commit;
+		struct histogram render;
+		struct histogram swap;
+		struct flip_counters flip;
+
+		/* commits sent as tearing flips, and how many of them bounced */
+		unsigned int async;
+		unsigned int async_rejected;
+
+		/* frames held back for a pending flip, and those replaced before it was done */
+		unsigned int queued;
+		unsigned int superseded;
+
+		/*
+		 * When the frame behind each fence started rendering.
+		 * Flip events arrive in fence order, so fence.flipped
+		 * tells which one just reached the screen. Only one
+		 * commit is ever in flight, but with -e its out fence can
+		 * let the next one go before the flip event is read, so
+		 * keep two.
+		 */
+		uint64_t frame_start;
+		uint64_t fence_start[2];
+		/* and the vblank it was committed for, 0 if unknown */
+		uint64_t target;
+		uint64_t fence_target[2];
+	} stats;
+
+	/*
+	 * Each CRTC flips at its own rate, so it gets its own timeline.
+	 * in_commit is set once the request being built carries any
+	 * property for this CRTC, which is what gets it a flip event.
+	 */
+	struct {
+		int next;
+		int last;
+		int completed;
+		int flipped;
+	} fence;
+	bool in_commit;
+	/* legacy: nothing but SetCrtc/SetPlane went out, so no flip event */
+	bool sync_commit;
+	/*
+	 * A frame that was ready while the previous one was still on its
+	 * way to the screen.  Its buffers stay in the planes' buf until
+	 * the flip completes and it can be sent, or a newer frame takes
+	 * its place.
+	 */
+	bool queued;
+
+	struct {
+		uint32_t mode_id;
+		uint32_t active;
+		uint32_t out_fence_ptr;
+		uint32_t connector_crtc_id;	/* CRTC_ID of the connector */
+		uint32_t vrr_enabled;
+	} prop;
 
-//	struct {
-//		uint32_t mode;
-//		uint32_t connector_ids;
-//	} prop;
+	/* MODE_ID blob for mode, or 0 when the display is to be off */
+	uint32_t mode_blob;
 
-	uint32_t connector_ids[8];
+	/* sync_file for the last commit, signals when it is on screen */
+	int32_t out_fence_fd;
+	/* where the kernel puts the next one, until the commit went through */
+	int32_t next_out_fence_fd;
 
 	struct my_plane *primary;
+
+	/* stacked above the primary, in this order */
+	struct my_plane *overlays;
+	int count_overlays;
 };
 
 struct my_plane {
@@ -114,9 +214,12 @@ struct my_plane {
 
 	bool enable;
 	uint32_t fb_id;
-#ifdef LEGACY_API
-	uint32_t old_fb_id;
-#endif
+	uint32_t format;
+	/* layouts the plane can scan out our format with, best first */
+	uint64_t modifiers[MAX_MODIFIERS];
+	unsigned int count_modifiers;
+	/* someone else's framebuffer, shown when there's no surface buffer */
+	uint32_t foreign_fb;
 
 	struct {
 		uint32_t src_x;
@@ -131,38 +234,115 @@ struct my_plane {
 
 		uint32_t fb;
 		uint32_t crtc;
+
+		uint32_t in_fence_fd;
+		uint32_t zpos;	/* only if we get to pick it */
 	} prop;
 
+	uint64_t zpos;
+
+	/*
+	 * Last value handed to the kernel for each of the above, so
+	 * only the properties that changed go into the request.  Not
+	 * valid until the plane has been fully committed once.
+	 */
+	bool shadow_valid;
+	struct {
+		uint64_t src_x;
+		uint64_t src_y;
+		uint64_t src_w;
+		uint64_t src_h;
+
+		uint64_t crtc_x;
+		uint64_t crtc_y;
+		uint64_t crtc_w;
+		uint64_t crtc_h;
+
+		uint64_t fb;
+		uint64_t crtc;
+
+		uint64_t zpos;
+	} shadow;
+
 	struct {
 		float ang;
 		float rad_dir;
 		float rad;
 		int w_dir;
-		int w;
+		float w;
 		int h_dir;
-		int h;
+		float h;
 	} state;
 };
 
 struct my_ctx {
 	int fd;
 	int count_crtcs;
-	struct my_plane *planes;
-#ifndef LEGACY_API
-	drmModePropertySetPtr set;
+	struct my_crtc *crtcs;
+	/*
+	 * The request is allocated once and rewound with the cursor
+	 * after each commit, so building a frame does not touch the
+	 * heap once libdrm's item array has grown to fit a frame.
+	 * drmModeAtomicCommit() still allocates its sorted copy of the
+	 * request on every call, which is out of our hands.
+	 */
+	drmModeAtomicReqPtr req;
 	uint32_t flags;
-#endif
+	bool pending;
+	bool modeset;	/* the request needs ALLOW_MODESET */
+
+	/*
+	 * debug: how often a request held more items than any before it.
+	 * Only then can libdrm have had to grow its item array, though it
+	 * grows it a chunk at a time, so not every new peak reallocated.
+	 */
+	struct {
+		unsigned int commits;
+		unsigned int req_peaks;
+		unsigned int steady_req_peaks;
+		int high_water;
+	} dbg;
 };
 
+static int count_overlays = 1;
 static bool throttle;
 static bool blur;
 static bool blank;
 static bool render = true;
-static int next_fence = 1, last_fence = 0, completed_fence = 0;
+static bool explicit_sync;
+static bool vrr;
+/* SetCrtc/SetPlane/PageFlip instead of atomic commits */
+static bool legacy;
+/* flip as soon as a frame is ready, tearing and all */
+static bool async_flip;
+/*
+ * Keep rendering while a flip is pending: the newest frame is the one
+ * that goes out when it completes, the ones it replaced go straight
+ * back to the pool (see crtc_commit()).
+ */
+static bool mailbox;
+/* buffers per surface, enough by default to keep rendering with -M */
+static unsigned int swap_depth = 4;
+/* tiled and compressed buffers, where the planes list them */
+static bool fb_modifiers = true;
+/* fewer bytes per pixel on the overlays is less to scan out */
+static const struct format_info *primary_format;
+static const struct format_info *overlay_format;
+/*
+ * Overlays show YUV video of this size instead of GL, scaled up by the
+ * plane: the path a video player takes.
+ */
+static unsigned int video_w, video_h;
+/*
+ * With a file of raw frames, the video buffers are udmabufs the
+ * display imports instead of its own dumb buffers.
+ */
+static int video_fd = -1;
+static unsigned int video_frames;
 
-static int get_free_buffer(struct my_surface *surf)
+static int get_free_buffer(struct my_crtc *c, struct my_surface *surf)
 {
-	if (throttle && (last_fence > completed_fence))
+	if (throttle && !mailbox && c->fence.last > c->fence.completed)
 		return -1;
 	if (surface_has_free_buffers(&surf->base))
 		return 0;
@@ -172,6 +352,17 @@ static int get_free_buffer(struct my_surface *surf)
 
 #define ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
 
+static int crtc_count_planes(const struct my_crtc *c)
+{
+	return 1 + c->count_overlays;
+}
+
+/* the primary, then the overlays from the bottom up */
+static struct my_plane *crtc_plane(struct my_crtc *c, int i)
+{
+	return i ? &c->overlays[i - 1] : c->primary;
+}
+
 static void plane_enable(struct my_plane *p, bool enable)
 {
 	if (p->enable == enable)
@@ -180,50 +371,131 @@ static void plane_enable(struct my_plane *p, bool enable)
 	p->dirty = true;
 }
 
-static void populate_crtc_props(int fd, struct my_crtc *c)
+static void populate_crtc_props(struct ctx *uctx, struct my_crtc *c)
 {
-	drmModeObjectPropertiesPtr props;
+	const struct obj_props *props;
 	uint32_t i;
 
-	props = drmModeObjectGetProperties(fd, c->base.crtc_id, DRM_MODE_OBJECT_CRTC);
+	props = get_obj_props(uctx, c->base.crtc_id, DRM_MODE_OBJECT_CRTC);
 	if (!props)
 		return;
 
-	for (i = 0; i < props->count_props; i++) {
-		drmModePropertyPtr prop;
-
-		prop = drmModeGetProperty(fd, props->props[i]);
-		if (!prop)
-			continue;
+	for (i = 0; i < props->props->count_props; i++) {
+		drmModePropertyPtr prop = props->info[i];
 
 		printf("crtc prop %s %u\n", prop->name, prop->prop_id);
 
-//		if (!strcmp(prop->name, "MODE"))
-//			c->prop.mode = prop->prop_id;
-//		else if (!strcmp(prop->name, "CONNECTOR_IDS"))
-//			c->prop.connector_ids = prop->prop_id;
+		if (!strcmp(prop->name, "MODE_ID"))
+			c->prop.mode_id = prop->prop_id;
+		else if (!strcmp(prop->name, "ACTIVE"))
+			c->prop.active = prop->prop_id;
+		else if (!strcmp(prop->name, "OUT_FENCE_PTR"))
+			c->prop.out_fence_ptr = prop->prop_id;
+		else if (!strcmp(prop->name, "VRR_ENABLED"))
+			c->prop.vrr_enabled = prop->prop_id;
+	}
+
+	props = get_obj_props(uctx, c->base.connector_id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->props->count_props; i++) {
+		drmModePropertyPtr prop = props->info[i];
+
+		printf("connector prop %s %u\n", prop->name, prop->prop_id);
+
+		if (!strcmp(prop->name, "CRTC_ID"))
+			c->prop.connector_crtc_id = prop->prop_id;
+		else if (!strcmp(prop->name, "vrr_capable"))
+			c->vrr_capable = props->props->prop_values[i];
+	}
+}
+
+/*
+ * Remembers the mode and primary plane framebuffer the CRTC is showing,
+ * if it's lit for our connector, so we can take it over without a
+ * modeset and give it back the same way.
+ */
+static void capture_original(struct ctx *uctx, struct my_crtc *c)
+{
+	drmModeCrtcPtr crtc = uctx->crtcs[c->base.crtc_idx];
+	const struct obj_props *props;
+	uint64_t crtc_id = 0, fb = 0, val;
+
+	memset(&c->original_mode, 0, sizeof c->original_mode);
+	c->original_fb = 0;
+
+	get_prop_value(get_obj_props(uctx, c->base.connector_id, DRM_MODE_OBJECT_CONNECTOR),
+		       "CRTC_ID", &crtc_id);
+	if (!crtc->mode_valid || crtc_id != c->base.crtc_id)
+		return;
+
+	c->original_mode = crtc->mode;
+
+	props = get_obj_props(uctx, c->primary->base.plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!get_prop_value(props, "CRTC_ID", &crtc_id) || crtc_id != c->base.crtc_id ||
+	    !get_prop_value(props, "FB_ID", &fb) || !fb)
+		return;
+
+	c->original_fb = fb;
+
+	get_prop_value(props, "SRC_X", &val);
+	c->original_src.x1 = val;
+	get_prop_value(props, "SRC_Y", &val);
+	c->original_src.y1 = val;
+	get_prop_value(props, "SRC_W", &val);
+	c->original_src.x2 = c->original_src.x1 + val;
+	get_prop_value(props, "SRC_H", &val);
+	c->original_src.y2 = c->original_src.y1 + val;
+	get_prop_value(props, "CRTC_X", &val);
+	c->original_dst.x1 = val;
+	get_prop_value(props, "CRTC_Y", &val);
+	c->original_dst.y1 = val;
+	get_prop_value(props, "CRTC_W", &val);
+	c->original_dst.x2 = c->original_dst.x1 + val;
+	get_prop_value(props, "CRTC_H", &val);
+	c->original_dst.y2 = c->original_dst.y1 + val;
+}
+
+/*
+ * Makes *mode (or off, for an empty one) what the next commit sets on
+ * the CRTC.  The blob for it is made here, once, rather than for every
+ * commit that carries the modeset.
+ */
+static bool crtc_set_mode(struct my_ctx *ctx, struct my_crtc *c,
+			  const drmModeModeInfo *mode)
+{
+	uint32_t blob = 0;
+
+	if (!legacy) {
+		if (mode->hdisplay &&
+		    kms->create_property_blob(ctx->fd, mode, sizeof *mode, &blob)) {
+			printf("can't create mode blob %d:%s\n", errno, strerror(errno));
+			return false;
+		}
 
-		drmModeFreeProperty(prop);
+		if (c->mode_blob)
+			kms->destroy_property_blob(ctx->fd, c->mode_blob);
 	}
 
-	drmModeFreeObjectProperties(props);
+	c->mode_blob = blob;
+	c->mode = *mode;
+	c->dirty_mode = true;
+
+	return true;
 }
 
-static void populate_plane_props(int fd, struct my_plane *p)
+static void populate_plane_props(struct ctx *uctx, struct my_plane *p)
 {
-	drmModeObjectPropertiesPtr props;
+	const struct obj_props *props;
 	uint32_t i;
 
-	props = drmModeObjectGetProperties(fd, p->base.plane_id, DRM_MODE_OBJECT_PLANE);
+	props = get_obj_props(uctx, p->base.plane_id, DRM_MODE_OBJECT_PLANE);
 	if (!props)
 		return;
 
-	for (i = 0; i < props->count_props; i++) {
-		drmModePropertyPtr prop;
-
-		prop = drmModeGetProperty(fd, props->props[i]);
-		if (!prop)
-			continue;
+	for (i = 0; i < props->props->count_props; i++) {
+		drmModePropertyPtr prop = props->info[i];
 
 		printf("plane prop %s %u\n", prop->name, prop->prop_id);
 
@@ -247,228 +519,598 @@ static void populate_plane_props(int fd, struct my_plane *p)
 			p->prop.fb = prop->prop_id;
 		else if (!strcmp(prop->name, "CRTC_ID"))
 			p->prop.crtc = prop->prop_id;
+		else if (!strcmp(prop->name, "IN_FENCE_FD"))
+			p->prop.in_fence_fd = prop->prop_id;
+		else if (!strcmp(prop->name, "zpos") &&
+			 !(prop->flags & DRM_MODE_PROP_IMMUTABLE))
+			p->prop.zpos = prop->prop_id;
+	}
+}
+
+/*
+ * Stacks the overlays above the primary in the order we keep them,
+ * on the drivers that let us choose.  A plane with an immutable zpos
+ * stays where it is, and the rest go above it.
+ */
+static void assign_zpos(struct ctx *uctx, struct my_crtc *c)
+{
+	uint64_t zpos = 0;
+	int i;
+
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		struct my_plane *p = crtc_plane(c, i);
+		const struct plane_caps *caps = &uctx->plane_caps[p->base.plane_idx];
+
+		if (!caps->has_zpos)
+			continue;
+
+		if (!p->prop.zpos) {
+			get_prop_value(get_obj_props(uctx, p->base.plane_id, DRM_MODE_OBJECT_PLANE),
+				       "zpos", &p->zpos);
+		} else {
+			p->zpos = max(zpos, caps->zpos_min);
+			p->zpos = min(p->zpos, caps->zpos_max);
+		}
 
-		drmModeFreeProperty(prop);
+		printf("plane id = %u zpos = %llu\n", p->base.plane_id,
+		       (unsigned long long) p->zpos);
+
+		zpos = p->zpos + 1;
 	}
+}
+
+
+/* refresh period of a mode in nanoseconds */
+static uint64_t mode_period(const drmModeModeInfo *mode)
+{
+	if (!mode->clock)
+		return 0;
+
+	return mode->htotal * mode->vtotal * 1000000ULL / mode->clock;
+}
+
+static void crtc_counters(const struct my_crtc *c, struct flip_counters *fc)
+{
+	*fc = c->stats.flip;
+}
 
-	drmModeFreeObjectProperties(props);
+static void crtc_complete(struct my_crtc *c)
+{
+	int i;
+
+	c->fence.completed++;
+	dprintf("complete [%u]: %d/%d\n", c->base.crtc_id, c->fence.completed, c->fence.last);
+
+	for (i = 0; i < crtc_count_planes(c); i++)
+		surface_retire_buffers(&crtc_plane(c, i)->surf.base, c->fence.completed);
+}
+
+/* whether the last commit is still on its way to the screen */
+static bool crtc_flip_pending(const struct my_crtc *c)
+{
+	return c->fence.completed < c->fence.last;
 }
 
+static void crtc_flush(struct my_ctx *ctx, struct my_crtc *c);
 
 static void page_flip_event(int fd, unsigned int seq, unsigned int tv_sec, unsigned int tv_usec,
-		void *user_data)
+		unsigned int crtc_id, void *user_data)
 {
 	struct my_ctx *ctx = user_data;
+	struct my_crtc *c = NULL;
+	int fence;
 	int i;
 
-	completed_fence++;
-	dprintf("complete: %d/%d\n", completed_fence, last_fence);
-
 	for (i = 0; i < ctx->count_crtcs; i++) {
-		struct my_plane *p = &ctx->planes[i];
-		struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
+		if (ctx->crtcs[i].base.crtc_id == crtc_id) {
+			c = &ctx->crtcs[i];
+			break;
+		}
+	}
 
-		surface_retire_buffers(&p->surf.base, completed_fence);
-		surface_retire_buffers(&c->primary->surf.base, completed_fence);
+	if (!c) {
+		dprintf("flip event for unknown crtc %u\n", crtc_id);
+		return;
 	}
+
+	fence = ++c->fence.flipped;
+	flip_counters_add(&c->stats.flip, seq,
+			  c->stats.fence_target[fence % ARRAY_SIZE(c->stats.fence_target)],
+			  tv_sec * 1000000000ULL + tv_usec * 1000ULL,
+			  c->vrr || async_flip ? 0 : mode_period(&c->mode),
+			  c->stats.fence_start[fence % ARRAY_SIZE(c->stats.fence_start)]);
+
+	/* with explicit sync the out fence retires the buffers */
+	if (!explicit_sync)
+		crtc_complete(c);
+
+	crtc_flush(ctx, c);
 }
 
-#if 0
-static void drmModePropertySetAdd2(drmModePropertySetPtr set, uint32_t obj_id, uint32_t prop_id, uint64_t value)
+/* the out fence of a commit signalled, ie. it reached the screen */
+static void out_fence_event(struct my_ctx *ctx, int i)
 {
-	printf("obj=%u, prop=%u, value=%llu\n", obj_id, prop_id, value);
-	drmModePropertySetAdd(set, obj_id, prop_id, value);
+	struct my_crtc *c = &ctx->crtcs[i];
+
+	close(c->out_fence_fd);
+	c->out_fence_fd = -1;
+
+	crtc_complete(c);
+	crtc_flush(ctx, c);
 }
 
-static void drmModePropertySetAddBlob2(drmModePropertySetPtr set, uint32_t obj_id, uint32_t prop_id,
-				       uint64_t length, void *blob)
+#if 0
+static int drmModeAtomicAddProperty2(drmModeAtomicReqPtr req, uint32_t obj_id, uint32_t prop_id, uint64_t value)
 {
-	printf("obj=%u, prop=%u, length=%llu, blob=%p\n", obj_id, prop_id, length, blob);
-	drmModePropertySetAddBlob(set, obj_id, prop_id, length, blob);
+	printf("obj=%u, prop=%u, value=%llu\n", obj_id, prop_id, (unsigned long long) value);
+	return drmModeAtomicAddProperty(req, obj_id, prop_id, value);
 }
 
-#define drmModePropertySetAdd drmModePropertySetAdd2
-#define drmModePropertySetAddBlob drmModePropertySetAddBlob2
+#define drmModeAtomicAddProperty drmModeAtomicAddProperty2
 #endif
 
+static void plane_add_prop(struct my_ctx *ctx, struct my_plane *p,
+			   uint32_t prop_id, uint64_t *shadow, uint64_t value)
+{
+	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
+
+	if (p->shadow_valid && *shadow == value)
+		return;
+
+	*shadow = value;
+	kms->atomic_add_property(ctx->req, p->base.plane_id, prop_id, value);
+	c->in_commit = true;
+}
+
 static void plane_commit(struct my_ctx *ctx, struct my_plane *p)
 {
 	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
-	int r;
+	uint32_t fb_id = p->buf ? p->buf->fb_id : p->enable ? p->foreign_fb : 0;
+
+	/*
+	 * note: setting CRTC but not FB angers danvet, so moving
+	 * the plane between CRTCs re-emits everything:
+	 */
+	if (p->shadow.crtc != (fb_id ? p->base.crtc->crtc_id : 0))
+		p->shadow_valid = false;
+
+	plane_add_prop(ctx, p, p->prop.fb, &p->shadow.fb, fb_id);
+	plane_add_prop(ctx, p, p->prop.crtc, &p->shadow.crtc,
+		       fb_id ? p->base.crtc->crtc_id : 0);
+	plane_add_prop(ctx, p, p->prop.src_x, &p->shadow.src_x,
+		       p->src.x1);
+	plane_add_prop(ctx, p, p->prop.src_y, &p->shadow.src_y,
+		       p->src.y1);
+	plane_add_prop(ctx, p, p->prop.src_w, &p->shadow.src_w,
+		       p->src.x2 - p->src.x1);
+	plane_add_prop(ctx, p, p->prop.src_h, &p->shadow.src_h,
+		       p->src.y2 - p->src.y1);
+	plane_add_prop(ctx, p, p->prop.crtc_x, &p->shadow.crtc_x,
+		       p->dst.x1);
+	plane_add_prop(ctx, p, p->prop.crtc_y, &p->shadow.crtc_y,
+		       p->dst.y1);
+	plane_add_prop(ctx, p, p->prop.crtc_w, &p->shadow.crtc_w,
+		       p->dst.x2 - p->dst.x1);
+	plane_add_prop(ctx, p, p->prop.crtc_h, &p->shadow.crtc_h,
+		       p->dst.y2 - p->dst.y1);
+	if (p->prop.zpos)
+		plane_add_prop(ctx, p, p->prop.zpos, &p->shadow.zpos, p->zpos);
+
+	/* let the kernel wait for rendering instead of us: */
+	if (explicit_sync && p->buf && p->surf.fence_fd >= 0) {
+		kms->atomic_add_property(ctx->req, p->base.plane_id,
+					 p->prop.in_fence_fd, p->surf.fence_fd);
+		c->in_commit = true;
+	}
+}
+
+/* gives back the buffers a CRTC's planes were about to show */
+static void crtc_put_buffers(struct my_crtc *c)
+{
+	int i;
+
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		struct my_plane *p = crtc_plane(c, i);
 
-	if (!p->dirty && !c->primary->dirty && !c->dirty_mode)
+		if (p->buf) {
+			surface_buffer_put_fb(&p->surf.base, p->buf);
+			p->buf = NULL;
+		}
+	}
+	c->queued = false;
+}
+
+/* adds the CRTC's frame, whose buffers are all in hand, to the request */
+static void crtc_emit(struct my_ctx *ctx, struct my_crtc *c)
+{
+	int i;
+
+	ctx->pending = true;
+
+	/* the legacy calls are made by commit_state(), not queued up */
+	if (legacy) {
+		c->in_commit = true;
 		return;
+	}
 
-	if (c->primary != p)
-		plane_commit(ctx, c->primary);
+	/* the modeset rides along with the frame, and with the other CRTCs' */
+	if (c->dirty_mode) {
+		kms->atomic_add_property(ctx->req, c->base.crtc_id,
+					 c->prop.mode_id, c->mode_blob);
+		kms->atomic_add_property(ctx->req, c->base.crtc_id,
+					 c->prop.active, !!c->mode_blob);
+		kms->atomic_add_property(ctx->req, c->base.connector_id,
+					 c->prop.connector_crtc_id,
+					 c->mode_blob ? c->base.crtc_id : 0);
+		c->in_commit = true;
+		ctx->modeset = true;
+	}
 
-	assert(p->buf == NULL);
+	if (c->dirty_vrr) {
+		kms->atomic_add_property(ctx->req, c->base.crtc_id,
+					 c->prop.vrr_enabled, c->vrr);
+		c->in_commit = true;
+	}
 
-#ifndef LEGACY_API
-	if (!ctx->set) {
-		ctx->set = drmModePropertySetAlloc();
-		if (!ctx->set)
-			return;
-		ctx->flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		struct my_plane *p = crtc_plane(c, i);
+
+		if (p->dirty)
+			plane_commit(ctx, p);
 	}
-#endif
+}
+
+/*
+ * Takes the new buffers of a CRTC's planes and adds everything that
+ * changed to the request.  The buffers are all taken up front, so a
+ * CRTC either gets a whole frame or nothing at all.
+ *
+ * Only one commit per CRTC can be in flight, so while the last one
+ * hasn't flipped the frame is queued instead, and sent from the flip
+ * event.  A frame that's ready before that replaces the queued one,
+ * plane by plane, rather than being thrown away with EBUSY.
+ */
+static void crtc_commit(struct my_ctx *ctx, struct my_crtc *c)
+{
+	bool dirty = c->dirty_mode || c->dirty_vrr;
+	bool superseded = false;
+	int i;
+
+	for (i = 0; i < crtc_count_planes(c); i++)
+		dirty |= crtc_plane(c, i)->dirty;
+	if (!dirty)
+		return;
+
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		struct my_plane *p = crtc_plane(c, i);
+		struct buffer *buf;
+
+		if (!p->dirty)
+			continue;
 
-	if (p->dirty && p->enable) {
-		p->buf = surface_get_front(ctx->fd, &p->surf.base);
-		if (!p->buf) {
-			if (c->primary->buf) {
-				surface_buffer_put_fb(&c->primary->surf.base, c->primary->buf);
-				c->primary->buf = NULL;
+		/* whatever was queued for it doesn't go on screen now */
+		if (!p->enable || p->foreign_fb) {
+			if (p->buf) {
+				surface_buffer_put_fb(&p->surf.base, p->buf);
+				p->buf = NULL;
 			}
+			continue;
+		}
+
+		buf = surface_get_front(ctx->fd, &p->surf.base);
+		if (buf && p->buf) {
+			surface_buffer_put_fb(&p->surf.base, p->buf);
+			superseded = true;
+		}
+		if (buf)
+			p->buf = buf;
+		else if (!p->buf) {
+			crtc_put_buffers(c);
 			return;
 		}
-		p->buf->fence = next_fence;
 	}
 
-#ifndef LEGACY_API
-	if (c->dirty_mode) {
-		r = drmModeSetCrtc(ctx->fd, c->base.crtc_id, c->primary->buf->fb_id,
-				0, 0, &c->base.connector_id, 1, &c->mode);
-		if (r)
-			printf("drmModeSetCrtc() failed %d:%s\n", errno, strerror(errno));
+	if (superseded)
+		c->stats.superseded++;
+
+	/* a modeset, or the last commit before exiting, is a blocking one */
+	if (crtc_flip_pending(c) && !c->dirty_mode &&
+	    (ctx->flags & DRM_MODE_ATOMIC_NONBLOCK)) {
+		if (!c->queued)
+			c->stats.queued++;
+		c->queued = true;
+		return;
 	}
 
-	if (p->dirty) {
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.fb,
-				      p->buf ? p->buf->fb_id : 0);
+	c->queued = false;
+	crtc_emit(ctx, c);
+}
 
-		/* note: setting CRTC but not FB angers danvet */
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.crtc,
-				      p->buf ? p->base.crtc->crtc_id : 0);
+/*
+ * Puts the CRTC back the way we found it: the old framebuffer goes
+ * back on the primary plane, and the mode only changes if ours was a
+ * different one.
+ */
+static void crtc_restore(struct my_ctx *ctx, struct my_crtc *c)
+{
+	struct my_plane *p = c->primary;
+	int i;
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.src_x,
-				      p->src.x1);
+	for (i = 0; i < c->count_overlays; i++)
+		plane_enable(&c->overlays[i], false);
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.src_y,
-				      p->src.y1);
+	if (c->vrr) {
+		c->vrr = false;
+		c->dirty_vrr = true;
+	}
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.src_w,
-				      p->src.x2 - p->src.x1);
+	if (!mode_equal(&c->mode, &c->original_mode))
+		crtc_set_mode(ctx, c, &c->original_mode);
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.src_h,
-				      p->src.y2 - p->src.y1);
+	p->foreign_fb = c->original_fb;
+	p->src = c->original_src;
+	p->dst = c->original_dst;
+	p->dirty = true;
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.crtc_x,
-				      p->dst.x1);
+	/* an inactive CRTC can't have planes on it */
+	plane_enable(p, c->original_fb && c->original_mode.hdisplay);
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.crtc_y,
-				      p->dst.y1);
+	crtc_commit(ctx, c);
+}
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.crtc_w,
-				      p->dst.x2 - p->dst.x1);
+static void print_plane(struct my_plane *p)
+{
+	unsigned int src_w = p->src.x2 - p->src.x1;
+	unsigned int src_h = p->src.y2 - p->src.y1;
+	unsigned int dst_w = p->dst.x2 - p->dst.x1;
+	unsigned int dst_h = p->dst.y2 - p->dst.y1;
+
+	printf("plane = %u, crtc = %u, fb = %u\n",
+	       p->base.plane_id, p->base.crtc->crtc_id, p->buf ? p->buf->fb_id : 0);
+
+	printf("src = %u.%06ux%u.%06u+%u.%06u+%u.%06u\n",
+	       src_w >> 16, ((src_w & 0xffff) * 15625) >> 10,
+	       src_h >> 16, ((src_h & 0xffff) * 15625) >> 10,
+	       p->src.x1 >> 16, ((p->src.x1 & 0xffff) * 15625) >> 10,
+	       p->src.y1 >> 16, ((p->src.y1 & 0xffff) * 15625) >> 10);
+
+	printf("dst = %ux%u+%d+%d\n",
+	       dst_w, dst_h, p->dst.x1, p->dst.y1);
+}
 
-		drmModePropertySetAdd(ctx->set,
-				      p->base.plane_id,
-				      p->prop.crtc_h,
-				      p->dst.y2 - p->dst.y1);
+/*
+ * Throws away the request built so far and gives back its buffers,
+ * leaving the planes dirty so the next frame sends everything again.
+ */
+static void drop_state(struct my_ctx *ctx)
+{
+	int i, j;
+
+	kms->atomic_set_cursor(ctx->req, 0);
+	ctx->pending = false;
+	ctx->modeset = false;
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		/* not part of the request, it waits for its flip */
+		if (c->queued)
+			continue;
+
+		/* the shadows no longer match what the kernel has */
+		for (j = 0; j < crtc_count_planes(c); j++) {
+			if (crtc_plane(c, j)->dirty)
+				crtc_plane(c, j)->shadow_valid = false;
+		}
+
+		crtc_put_buffers(c);
+		c->in_commit = false;
 	}
+}
 
-#else
-	if (c->dirty || c->dirty_mode) {
-		r = drmModeSetCrtc(ctx->fd, c->base.crtc_id, c->buf->fb_id,
-				   0, 0, &c->base.connector_id, 1, &c->mode);
-		if (r)
-			printf("drmModeSetCrtc() failed %d:%s\n", errno, strerror(errno));
+static void commit_state(struct my_ctx *ctx);
+
+/*
+ * The kernel turned the request down with EBUSY as some CRTC still had
+ * a flip pending.  The frames of the CRTCs with one are queued, to go
+ * out from their flip events rather than be dropped, and the rest go
+ * again right away instead of waiting for the next frame.  If nothing
+ * in the request had a flip pending there's no telling who's busy, so
+ * all of it waits.
+ */
+static void defer_state(struct my_ctx *ctx)
+{
+	bool split = false;
+	int i, j;
+
+	kms->atomic_set_cursor(ctx->req, 0);
+	ctx->pending = false;
+	ctx->modeset = false;
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (!c->in_commit)
+			continue;
+
+		for (j = 0; j < crtc_count_planes(c); j++) {
+			if (crtc_plane(c, j)->dirty)
+				crtc_plane(c, j)->shadow_valid = false;
+		}
+
+		if (crtc_flip_pending(c))
+			split = true;
 	}
 
-	if (p->dirty) {
-		r = drmModeSetPlane(ctx->fd, p->base.plane_id,
-				p->base.crtc->crtc_id,
-				p->buf ? p->buf->fb_id : 0,
-				0,
-				p->dst.x1, p->dst.y1,
-				p->dst.x2 - p->dst.x1,
-				p->dst.y2 - p->dst.y1,
-				p->src.x1, p->src.y1,
-				p->src.x2 - p->src.x1,
-				p->src.y2 - p->src.y1);
-		if (r)
-			printf("drmModeSetPlane() failed %d:%s\n", errno, strerror(errno));
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (!c->in_commit)
+			continue;
+
+		c->in_commit = false;
+
+		if (split && !crtc_flip_pending(c)) {
+			crtc_emit(ctx, c);
+			continue;
+		}
+
+		c->stats.queued++;
+		c->queued = true;
 	}
-#endif
+
+	/* everything in this one is free to flip */
+	commit_state(ctx);
 }
 
-static void tp_sub(struct timespec *tp, const struct timespec *tp2)
+/*
+ * Asks the kernel whether the request built so far would go through,
+ * without touching the hardware.  Done before the out fences are added,
+ * as a successful test would hand out fences that never signal.
+ */
+static bool test_state(struct my_ctx *ctx)
+{
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	int r;
+
+	/* there's no asking with the legacy API, it just has to work */
+	if (!ctx->pending || legacy)
+		return true;
+
+	if (ctx->modeset)
+		flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+
+	r = kms->atomic_commit(ctx->fd, ctx->req, flags, ctx);
+	if (r)
+		printf("configuration rejected %d:%s\n", errno, strerror(errno));
+
+	return !r;
+}
+
+/*
+ * Gives up the topmost overlay of whichever CRTC has the most of them,
+ * as the likeliest way to get under whatever shared limit (bandwidth,
+ * scalers, ...) the kernel ran into.  The request is dropped, so every
+ * CRTC needs a new frame afterwards.
+ */
+static bool drop_overlay(struct my_ctx *ctx, EGLDisplay dpy)
 {
-	tp->tv_sec -= tp2->tv_sec;
-	tp->tv_nsec -= tp2->tv_nsec;
-	if (tp->tv_nsec < 0) {
-		tp->tv_nsec += 1000000000L;
-		tp->tv_sec--;
+	struct my_crtc *victim = NULL;
+	struct my_plane *p;
+	int i;
+
+	drop_state(ctx);
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (c->count_overlays &&
+		    (!victim || c->count_overlays > victim->count_overlays))
+			victim = c;
 	}
+
+	if (!victim)
+		return false;
+
+	p = &victim->overlays[--victim->count_overlays];
+
+	printf("dropping plane id = %u from crtc id = %u\n",
+	       p->base.plane_id, victim->base.crtc_id);
+
+	if (p->surf.gl)
+		gl_surf_fini(dpy, &p->surf);
+	if (p->surf.fence_fd >= 0)
+		close(p->surf.fence_fd);
+	surface_free(&p->surf.base);
+	release_plane(&p->base);
+
+	return true;
 }
 
-static void commit_state(struct my_ctx *ctx)
+static bool commit_atomic(struct my_ctx *ctx)
 {
-	struct timespec pre, post;
-	int i, r;
+	uint32_t flags = ctx->flags;
+	uint64_t pre, post;
+	int cursor;
+	int i, j, r;
 
-#ifndef LEGACY_API
-	if (!ctx->set)
-		return;
+	if (explicit_sync) {
+		for (i = 0; i < ctx->count_crtcs; i++) {
+			struct my_crtc *c = &ctx->crtcs[i];
+
+			if (!c->in_commit)
+				continue;
+
+			kms->atomic_add_property(ctx->req, c->base.crtc_id,
+						 c->prop.out_fence_ptr,
+						 (uintptr_t) &c->next_out_fence_fd);
+		}
+	}
+
+	cursor = kms->atomic_get_cursor(ctx->req);
+	if (cursor > ctx->dbg.high_water) {
+		ctx->dbg.high_water = cursor;
+		ctx->dbg.req_peaks++;
+		if (ctx->dbg.commits)
+			ctx->dbg.steady_req_peaks++;
+	}
+	ctx->dbg.commits++;
+
+	/*
+	 * Every display that needs a modeset gets it in this one commit.
+	 * It waits for the flips still pending instead of failing with
+	 * EBUSY, a modeset being slow either way.
+	 */
+	if (ctx->modeset)
+		flags = (flags & ~DRM_MODE_ATOMIC_NONBLOCK) | DRM_MODE_ATOMIC_ALLOW_MODESET;
+	else if (async_flip)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+	pre = stats_now();
+	r = kms->atomic_commit(ctx->fd, ctx->req, flags, ctx);
+
+	/*
+	 * Drivers only take tearing flips that change nothing but the
+	 * primary plane's framebuffer, so when the overlays moved too
+	 * the same request goes again, on vblank.
+	 */
+	if (r && errno == EINVAL && (flags & DRM_MODE_PAGE_FLIP_ASYNC)) {
+		for (i = 0; i < ctx->count_crtcs; i++) {
+			if (ctx->crtcs[i].in_commit)
+				ctx->crtcs[i].stats.async_rejected++;
+		}
+		flags &= ~DRM_MODE_PAGE_FLIP_ASYNC;
+		r = kms->atomic_commit(ctx->fd, ctx->req, flags, ctx);
+	}
+	post = stats_now();
 
-	dprintf("kick: %d/%d\n", completed_fence, next_fence);
-	last_fence = next_fence;
-	next_fence++;
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		if (!ctx->crtcs[i].in_commit)
+			continue;
 
-	clock_gettime(CLOCK_MONOTONIC, &pre);
-	//r = drmModePropertySetCommit(fd, DRM_MODE_ATOMIC_TEST_ONLY, set);
-	r = drmModePropertySetCommit(ctx->fd, ctx->flags, ctx, ctx->set);
-	clock_gettime(CLOCK_MONOTONIC, &post);
-	tp_sub(&post, &pre);
+		hist_add(&ctx->crtcs[i].stats.commit, post - pre);
+		if (flags & DRM_MODE_PAGE_FLIP_ASYNC)
+			ctx->crtcs[i].stats.async++;
+	}
 
-	printf("commit took %lu secs, %lu nsecs\n", post.tv_sec, post.tv_nsec);
+	if (r && errno == EBUSY) {
+		defer_state(ctx);
+		return false;
+	}
 
-	drmModePropertySetFree(ctx->set);
-	ctx->set = NULL;
+	kms->atomic_set_cursor(ctx->req, 0);
+	ctx->pending = false;
+	ctx->modeset = false;
 
 	if (r) {
 		printf("setatomic returned %d:%s\n", errno, strerror(errno));
 
 		for (i = 0; i < ctx->count_crtcs; i++) {
-			struct my_plane *p = &ctx->planes[i];
-			struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
-
-			if (p->dirty) {
-				unsigned int src_w = p->src.x2 - p->src.x1;
-				unsigned int src_h = p->src.y2 - p->src.y1;
-				unsigned int dst_w = p->dst.x2 - p->dst.x1;
-				unsigned int dst_h = p->dst.y2 - p->dst.y1;
-
-				printf("plane = %u, crtc = %u, fb = %u\n",
-				       p->base.plane_id, p->base.crtc->crtc_id, p->buf ? p->buf->fb_id : 0);
-
-				printf("src = %u.%06ux%u.%06u+%u.%06u+%u.%06u\n",
-				       src_w >> 16, ((src_w & 0xffff) * 15625) >> 10,
-				       src_h >> 16, ((src_h & 0xffff) * 15625) >> 10,
-				       p->src.x1 >> 16, ((p->src.x1 & 0xffff) * 15625) >> 10,
-				       p->src.y1 >> 16, ((p->src.y1 & 0xffff) * 15625) >> 10);
-
-				printf("dst = %ux%u+%d+%d\n",
-				       dst_w, dst_h, p->dst.x1, p->dst.y1);
+			struct my_crtc *c = &ctx->crtcs[i];
+
+			for (j = 1; j < crtc_count_planes(c); j++) {
+				if (crtc_plane(c, j)->dirty)
+					print_plane(crtc_plane(c, j));
 			}
 
 			if (c->primary->dirty)
@@ -478,71 +1120,283 @@ static void commit_state(struct my_ctx *ctx)
 			if (c->dirty_mode) {
 				print_mode("mode", &c->mode);
 
-				printf("connector_id = %u\n", c->connector_ids[0]);
+				printf("connector_id = %u\n", c->base.connector_id);
 			}
+		}
 
-			if (p->buf) {
-				surface_buffer_put_fb(&p->surf.base, p->buf);
-				p->buf = NULL;
-			}
-			if (c->primary->buf) {
-				surface_buffer_put_fb(&c->primary->surf.base, c->primary->buf);
-				c->primary->buf = NULL;
+		drop_state(ctx);
+		return false;
+	}
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (!c->in_commit)
+			continue;
+
+		/* the kernel holds its own reference to the in fences */
+		for (j = 0; j < crtc_count_planes(c); j++) {
+			struct my_plane *p = crtc_plane(c, j);
+
+			if (p->buf && p->surf.fence_fd >= 0) {
+				close(p->surf.fence_fd);
+				p->surf.fence_fd = -1;
 			}
-			next_fence--;
 		}
+
+		if (!explicit_sync)
+			continue;
+
+		/*
+		 * A nonblocking commit is only accepted once the
+		 * previous one has flipped, so an older fence that
+		 * we haven't seen signal yet is done by now.
+		 */
+		if (c->out_fence_fd >= 0) {
+			close(c->out_fence_fd);
+			crtc_complete(c);
+		}
+		c->out_fence_fd = c->next_out_fence_fd;
+		c->next_out_fence_fd = -1;
+	}
+
+	return true;
+}
+
+static int overlay_commit_legacy(struct my_ctx *ctx, struct my_crtc *c,
+				 struct my_plane *p)
+{
+	int r;
+
+	r = kms->set_plane(ctx->fd, p->base.plane_id,
+			   p->buf ? c->base.crtc_id : 0,
+			   p->buf ? p->buf->fb_id : 0, 0,
+			   p->dst.x1, p->dst.y1,
+			   p->dst.x2 - p->dst.x1,
+			   p->dst.y2 - p->dst.y1,
+			   p->src.x1, p->src.y1,
+			   p->src.x2 - p->src.x1,
+			   p->src.y2 - p->src.y1);
+	if (r)
+		printf("drmModeSetPlane() failed %d:%s\n", errno, strerror(errno));
+
+	return r;
+}
+
+/*
+ * The legacy API takes a display apart: the mode and primary plane go
+ * with SetCrtc or a page flip, each overlay with a SetPlane of its own,
+ * so nothing is committed atomically.  Only a page flip completes with
+ * an event, anything else is on screen by the time the call returns.
+ */
+static void crtc_commit_legacy(struct my_ctx *ctx, struct my_crtc *c)
+{
+	struct my_plane *p = c->primary;
+	uint32_t fb_id = p->buf ? p->buf->fb_id : p->enable ? p->foreign_fb : 0;
+	int i, r;
+
+	c->sync_commit = true;
+
+	/* overlays go away first, in case the mode gets smaller */
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *o = &c->overlays[i];
+
+		if (o->dirty && !o->buf && overlay_commit_legacy(ctx, c, o))
+			return;
+	}
+
+	/* a new mode, or someone else's framebuffer, needs a SetCrtc */
+	if (c->dirty_mode || (p->dirty && !p->buf)) {
+		if (fb_id && c->mode.hdisplay)
+			r = kms->set_crtc(ctx->fd, c->base.crtc_id, fb_id,
+					  p->src.x1 >> 16, p->src.y1 >> 16,
+					  &c->base.connector_id, 1, &c->mode);
+		else
+			r = kms->set_crtc(ctx->fd, c->base.crtc_id, 0, 0, 0,
+					  NULL, 0, NULL);
+		if (r) {
+			printf("drmModeSetCrtc() failed %d:%s\n", errno, strerror(errno));
+			return;
+		}
+	}
+
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *o = &c->overlays[i];
+
+		if (o->dirty && o->buf && overlay_commit_legacy(ctx, c, o))
+			return;
+	}
+
+	if (c->dirty_mode || !p->dirty || !p->buf)
 		return;
+
+	if (async_flip) {
+		r = kms->page_flip(ctx->fd, c->base.crtc_id, p->buf->fb_id,
+				   DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_PAGE_FLIP_ASYNC, ctx);
+		if (!r)
+			c->stats.async++;
+		else if (errno == EINVAL)
+			c->stats.async_rejected++;
 	}
-#endif
+
+	/* a flip the driver won't tear goes on vblank instead */
+	if (!async_flip || (r && errno == EINVAL))
+		r = kms->page_flip(ctx->fd, c->base.crtc_id, p->buf->fb_id,
+				   DRM_MODE_PAGE_FLIP_EVENT, ctx);
+	if (r)
+		printf("drmModePageFlip() failed %d:%s\n", errno, strerror(errno));
+	else
+		c->sync_commit = false;
+}
+
+static void commit_legacy(struct my_ctx *ctx)
+{
+	uint64_t pre, post;
+	int i;
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (!c->in_commit)
+			continue;
+
+		pre = stats_now();
+		crtc_commit_legacy(ctx, c);
+		post = stats_now();
+
+		hist_add(&c->stats.commit, post - pre);
+	}
+
+	ctx->pending = false;
+}
+
+/*
+ * The earliest vblank a commit made now can land on: the next one, or
+ * the one after a flip that's still pending.
+ */
+static void crtc_target(struct my_ctx *ctx, struct my_crtc *c)
+{
+	uint64_t seq, ns;
+	uint64_t prev = c->stats.target;
+
+	if (kms->get_sequence(ctx->fd, c->base.crtc_id, &seq, &ns)) {
+		c->stats.target = 0;
+		return;
+	}
+
+	c->stats.target = seq + 1;
+	if (prev && c->fence.flipped < c->fence.last && c->stats.target <= prev)
+		c->stats.target = prev + 1;
+}
+
+static void commit_state(struct my_ctx *ctx)
+{
+	int i, j;
+
+	if (!ctx->pending)
+		return;
+
+	dprintf("kick\n");
+
+	for (i = 0; i < ctx->count_crtcs; i++) {
+		if (ctx->crtcs[i].in_commit)
+			crtc_target(ctx, &ctx->crtcs[i]);
+	}
+
+	if (legacy)
+		commit_legacy(ctx);
+	else if (!commit_atomic(ctx))
+		return;
 
 	for (i = 0; i < ctx->count_crtcs; i++) {
-		struct my_plane *p = &ctx->planes[i];
-		struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
-
-#ifdef LEGACY_API
-		if (p->old_fb_id) {
-			struct buffer *buf = surface_find_buffer_by_fb_id(&p->surf.base, p->old_fb_id);
-			if (buf)
-				surface_buffer_put_fb(&p->surf.base, buf);
+		struct my_crtc *c = &ctx->crtcs[i];
+
+		if (c->queued)
+			continue;
+
+		/*
+		 * Buffers of a CRTC that ended up with nothing to send
+		 * won't get a flip event to retire them, so give them
+		 * straight back.  Its shadows are only what the kernel
+		 * has if they went out in the request.
+		 */
+		if (c->in_commit) {
+			for (j = 0; j < crtc_count_planes(c); j++) {
+				struct my_plane *p = crtc_plane(c, j);
+
+				if (p->dirty && !legacy)
+					p->shadow_valid = true;
+			}
+
+			c->fence.last = c->fence.next++;
+			c->stats.fence_start[c->fence.last % ARRAY_SIZE(c->stats.fence_start)] =
+				c->stats.frame_start;
+			c->stats.fence_target[c->fence.last % ARRAY_SIZE(c->stats.fence_target)] =
+				c->stats.target;
 		}
 
-		if (c->old_fb_id) {
-			struct buffer *buf = surface_find_buffer_by_fb_id(&c->surf.base, c->old_fb_id);
-			if (buf)
-				surface_buffer_put_fb(&c->surf.base, buf);
+		for (j = 0; j < crtc_count_planes(c); j++) {
+			struct my_plane *p = crtc_plane(c, j);
+
+			if (!p->buf)
+				continue;
+
+			if (c->in_commit)
+				surface_buffer_queue(&p->surf.base, p->buf, c->fence.last);
+			else
+				surface_buffer_put_fb(&p->surf.base, p->buf);
 		}
 
-		p->old_fb_id = p->buf ? p->buf->fb_id : 0;
-		c->old_fb_id = c->buf ? c->buf->fb_id : 0;
-#endif
+		/* no event comes for what's already on screen */
+		if (legacy && c->in_commit && c->sync_commit) {
+			c->fence.flipped++;
+			crtc_complete(c);
+		}
+		c->in_commit = false;
 
-		p->dirty = false;
-		p->buf = NULL;
-		c->primary->dirty = false;
+		for (j = 0; j < crtc_count_planes(c); j++) {
+			crtc_plane(c, j)->dirty = false;
+			crtc_plane(c, j)->buf = NULL;
+		}
 		c->dirty_mode = false;
-		c->primary->buf = NULL;
+		c->dirty_vrr = false;
 	}
 }
 
-static float adjust_angle(struct my_plane *p)
+/* sends a CRTC's queued frame, once the one before it has flipped */
+static void crtc_flush(struct my_ctx *ctx, struct my_crtc *c)
+{
+	if (!c->queued || crtc_flip_pending(c))
+		return;
+
+	c->queued = false;
+	crtc_emit(ctx, c);
+	commit_state(ctx);
+}
+
+/*
+ * The adjust_*() helpers move a plane along by 'steps' frames' worth
+ * of motion at 60Hz, so the speed is the same at any refresh rate.
+ */
+static float adjust_angle(struct my_plane *p, float steps)
 {
 	const float ang_adj = M_PI / 500.0f;
 
-	p->state.ang += ang_adj;
+	p->state.ang += ang_adj * steps;
 	if (p->state.ang > 2.0f * M_PI)
 		p->state.ang -= 2.0f * M_PI;
 
 	return p->state.ang;
 }
 
-static float adjust_radius(struct my_plane *p)
+static float adjust_radius(struct my_plane *p, float steps)
 {
 	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
 	float rad_max = sqrtf(c->dispw * c->dispw + c->disph * c->disph) / 2.0f;
 	float rad_min = -rad_max;
 	float rad_adj = rad_max / 500.0f;
 
-	p->state.rad += rad_adj * p->state.rad_dir;
+	p->state.rad += rad_adj * steps * p->state.rad_dir;
 	if (p->state.rad > rad_max && p->state.rad_dir > 0.0f) {
 		p->state.rad_dir = -p->state.rad_dir;
 	} else if (p->state.rad < rad_min && p->state.rad_dir < 0.0f) {
@@ -552,13 +1406,13 @@ static float adjust_radius(struct my_plane *p)
 	return p->state.rad;
 }
 
-static int adjust_w(struct my_plane *p)
+static int adjust_w(struct my_plane *p, float steps)
 {
 	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
 	int w_max = c->dispw;
-	int w_adj = 1;//c->dispw / 100;
+	float w_adj = 1.0f;//c->dispw / 100;
 
-	p->state.w += w_adj * p->state.w_dir;
+	p->state.w += w_adj * steps * p->state.w_dir;
 	if (p->state.w > w_max && p->state.w_dir > 0) {
 		p->state.w_dir = -p->state.w_dir;
 	} else if (p->state.w < 0 && p->state.w_dir < 0) {
@@ -569,13 +1423,13 @@ static int adjust_w(struct my_plane *p)
 	return p->state.w;
 }
 
-static int adjust_h(struct my_plane *p)
+static int adjust_h(struct my_plane *p, float steps)
 {
 	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
 	int h_max = c->disph;
-	int h_adj = 1;//c->disph / 100;
+	float h_adj = 1.0f;//c->disph / 100;
 
-	p->state.h += h_adj * p->state.h_dir;
+	p->state.h += h_adj * steps * p->state.h_dir;
 	if (p->state.h > h_max && p->state.h_dir > 0) {
 		p->state.h_dir = -p->state.h_dir;
 	} else if (p->state.h < 0 && p->state.h_dir < 0) {
@@ -586,7 +1440,8 @@ static int adjust_h(struct my_plane *p)
 	return p->state.h;
 }
 
-static void do_render(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf, bool col, bool blur)
+static void do_render(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf, bool col, bool blur,
+		      uint64_t now)
 {
 	static const GLfloat verts[3][2] = {
 		{ -1, -1, },
@@ -600,6 +1455,10 @@ static void do_render(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf, b
 	};
 	GLfloat ar = (GLfloat) surf->base.width / (GLfloat) surf->base.height;
 
+	/* no GL at all on the fake device */
+	if (!surf->gl)
+		return;
+
 #if 0
 	if (col) {
 		surf->view_rotx += 0.25f;
@@ -644,7 +1503,7 @@ static void do_render(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf, b
 	glPopMatrix();
 #else
 	if (render)
-		gl_surf_render(dpy, ctx, surf, col, true, blur);
+		gl_surf_render(dpy, ctx, surf, col, true, blur, now);
 	if (blank)
 		gl_surf_clear(dpy, ctx, surf, false);
 #endif
@@ -653,18 +1512,68 @@ static void do_render(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf, b
 static void clear_rect(EGLDisplay dpy, EGLContext ctx, struct my_surface *surf,
 		       int x, int y, int w, int h)
 {
-	glViewport(0, 0, (GLint) surf->base.width, (GLint) surf->base.height);
-	glScissor(x, surf->base.height - y - h, w, h);
-	glEnable(GL_SCISSOR_TEST);
-	glClearColor(0.0, 0.0, 0.0, 0.0);
-	glClear(GL_COLOR_BUFFER_BIT);
-	glDisable(GL_SCISSOR_TEST);
+	if (!surf->gl || !gl_surf_bind(surf))
+		return;
+
+	/* an fb's rows are in scanout order, unlike a window surface's */
+	glViewport(0, 0, (GLint) surf->base.width, (GLint) surf->base.height);
+	glScissor(x, y, w, h);
+	glEnable(GL_SCISSOR_TEST);
+	glClearColor(0.0, 0.0, 0.0, 0.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+	glDisable(GL_SCISSOR_TEST);
+}
+
+static void swap_buffers(EGLDisplay dpy, struct my_surface *surf)
+{
+	if (surf->gl)
+		gl_surf_resolve(surf);
+
+	if (surf->gl && explicit_sync) {
+		if (surf->fence_fd >= 0)
+			close(surf->fence_fd);
+		surf->fence_fd = gl_fence_fd(dpy);
+	} else if (surf->gl) {
+		/* the kernel can only wait for rendering that's been submitted */
+		glFlush();
+	}
+
+	surface_swap(&surf->base);
+}
+
+/*
+ * The layouts a plane can scan fmt out with, in the order IN_FORMATS
+ * lists them.  None when the driver doesn't say, which leaves the
+ * layout to the allocator.
+ */
+static void plane_pick_modifiers(struct ctx *uctx, struct my_plane *p, uint32_t fmt)
+{
+	const struct plane_caps *caps = &uctx->plane_caps[p->base.plane_idx];
+	int i;
+
+	p->count_modifiers = 0;
+
+	if (!fb_modifiers)
+		return;
+
+	for (i = 0; i < caps->count_formats && p->count_modifiers < MAX_MODIFIERS; i++) {
+		if (caps->formats[i].format != fmt ||
+		    caps->formats[i].modifier == DRM_FORMAT_MOD_INVALID)
+			continue;
+
+		p->modifiers[p->count_modifiers++] = caps->formats[i].modifier;
+	}
 }
 
-static void swap_buffers(EGLDisplay dpy, struct my_surface *surf)
+static void print_layout(const struct my_plane *p)
 {
-	//glFlush();
-	eglSwapBuffers(dpy, surf->egl_surface);
+	uint64_t modifier = p->surf.base.buffers[0].modifier;
+
+	if (modifier == DRM_FORMAT_MOD_INVALID)
+		printf("plane id = %u implicit layout\n", p->base.plane_id);
+	else
+		printf("plane id = %u modifier = 0x%016llx\n", p->base.plane_id,
+		       (unsigned long long) modifier);
 }
 
 static const EGLint attribs[] = {
@@ -679,46 +1588,128 @@ static const EGLint attribs[] = {
 };
 
 static bool my_surface_alloc(struct my_surface *s,
+			     int fd,
 			     struct gbm_device *gbm,
 			     unsigned int fmt,
 			     unsigned int w,
 			     unsigned int h,
+			     const uint64_t *modifiers,
+			     unsigned int count_modifiers,
 			     EGLDisplay dpy)
 {
-	EGLint num_configs = 0;
-	EGLConfig config;
+	s->fence_fd = -1;
 
-	if (!eglChooseConfig(dpy, attribs, &config, 1, &num_configs) || num_configs != 1)
+	if (!surface_alloc(&s->base, fd, gbm, fmt, w, h, swap_depth,
+			   modifiers, count_modifiers))
 		return false;
 
-	if (!surface_alloc(&s->base, gbm, fmt, w, h))
-		return false;
+	if (!gbm)
+		return true;
+
+	return gl_surf_init(dpy, s);
+}
+
+static bool my_video_alloc(struct my_surface *s,
+			   int fd,
+			   unsigned int fmt,
+			   unsigned int w,
+			   unsigned int h)
+{
+	s->fence_fd = -1;
+	s->video = true;
+
+	if (video_fd >= 0)
+		return surface_alloc_udmabuf(&s->base, fd, fmt, w, h, swap_depth);
+
+	return surface_alloc_dumb(&s->base, fd, fmt, w, h, swap_depth);
+}
+
+/*
+ * The next video frame, which moves at 60 frames a second whatever
+ * the flip rate.  False if it couldn't be read whole.
+ */
+static bool produce_video(struct my_surface *surf, uint64_t now)
+{
+	struct buffer *b = surface_get_back(&surf->base);
 
-	if (!gl_surf_init(dpy, config, s))
+	if (!render)
+		return true;
+
+	if (video_fd < 0) {
+		video_fill(&surf->base, b, now / 16666667);
+		return true;
+	}
+
+	if (!video_read(&surf->base, b, video_fd, now / 16666667 % video_frames)) {
+		printf("can't read video frame %d:%s\n", errno, strerror(errno));
 		return false;
+	}
 
 	return true;
 }
 
-static bool produce_frame(EGLDisplay dpy, EGLContext ctx, struct my_plane *p)
+static bool produce_frame(EGLDisplay dpy, EGLContext ctx, struct my_crtc *c)
 {
-	struct my_crtc *c = container_of(p->base.crtc, struct my_crtc, base);
+	uint64_t t0, t1, t2, t3, t4;
+	uint64_t render_ns, swap_ns;
+	bool ok = true;
+	int i;
 
-	if (get_free_buffer(&c->primary->surf) < 0 || get_free_buffer(&p->surf) < 0)
-		return false;
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		if (get_free_buffer(c, &crtc_plane(c, i)->surf) < 0)
+			return false;
+	}
+
+	t0 = stats_now();
+	c->stats.frame_start = t0;
+	do_render(dpy, ctx, &c->primary->surf, false, blur, t0);
+	for (i = 0; anim_clear && i < c->count_overlays; i++) {
+		struct my_plane *p = &c->overlays[i];
 
-	do_render(dpy, ctx, &c->primary->surf, false, blur);
-	if (anim_clear)
 		clear_rect(dpy, ctx, &c->primary->surf,
 			   p->dst.x1,
 			   p->dst.y1,
 			   p->dst.x2 - p->dst.x1,
 			   p->dst.y2 - p->dst.y1);
+	}
+	t1 = stats_now();
 	swap_buffers(dpy, &c->primary->surf);
-	do_render(dpy, ctx, &p->surf, true, blur);
-	swap_buffers(dpy, &p->surf);
+	t2 = stats_now();
+
+	render_ns = t1 - t0;
+	swap_ns = t2 - t1;
+
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *p = &c->overlays[i];
+
+		/*
+		 * A frame that didn't arrive whole stays in the back
+		 * buffer to be read over, and nothing gets committed:
+		 * what's on screen stays.
+		 */
+		if (p->surf.video && !produce_video(&p->surf, t0)) {
+			ok = false;
+			t2 = stats_now();
+			continue;
+		}
 
-	return true;
+		do_render(dpy, ctx, &p->surf, true, blur, t0);
+		t3 = stats_now();
+		swap_buffers(dpy, &p->surf);
+		t4 = stats_now();
+
+		render_ns += t3 - t2;
+		swap_ns += t4 - t3;
+		t2 = t4;
+	}
+
+	hist_add(&c->stats.render, render_ns);
+	hist_add(&c->stats.swap, swap_ns);
+
+	for (i = 0; !ok && i < crtc_count_planes(c); i++)
+		surface_drop_front(&crtc_plane(c, i)->surf.base);
+
+	return ok;
 }
 
 static bool handle_crtc(struct my_ctx *my_ctx,
@@ -726,12 +1717,22 @@ static bool handle_crtc(struct my_ctx *my_ctx,
 			EGLDisplay dpy,
 			EGLContext ctx,
 			const char *mode_name,
-			struct my_crtc *c, struct my_plane *p)
+			struct my_crtc *c)
 {
-	if (!pick_mode(&c->base, &c->mode, mode_name))
+	drmModeModeInfo mode;
+	int i;
+
+	if (!pick_mode(&c->base, &mode, mode_name))
 		return false;
 
-	c->dirty_mode = true;
+	/* already showing the mode, so just flip our buffers in */
+	if (mode_equal(&mode, &c->original_mode)) {
+		printf("crtc id = %u already in mode %s, no modeset\n",
+		       c->base.crtc_id, mode.name);
+		c->mode = mode;
+	} else if (!crtc_set_mode(my_ctx, c, &mode)) {
+		return false;
+	}
 
 	if (0) {
 #if 0
@@ -839,50 +1840,70 @@ static bool handle_crtc(struct my_ctx *my_ctx,
 	c->dispw = c->mode.hdisplay;
 	c->disph = c->mode.vdisplay;
 
-	if (!my_surface_alloc(&p->surf, gbm, DRM_FORMAT_XRGB8888, 512, 512, dpy))
-		return false;
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *p = &c->overlays[i];
+		unsigned int w, h;
+
+		if (video_w) {
+			if (!my_video_alloc(&p->surf, my_ctx->fd, p->format,
+					    video_w, video_h)) {
+				printf("can't allocate video buffers %d:%s\n",
+				       errno, strerror(errno));
+				return false;
+			}
+		} else if (!my_surface_alloc(&p->surf, my_ctx->fd, gbm, p->format, 512, 512,
+					     p->modifiers, p->count_modifiers, dpy)) {
+			return false;
+		}
+		print_layout(p);
+
+		p->src.x1 = 0 << 16;
+		p->src.y1 = 0 << 16;
+		p->src.x2 = p->surf.base.width << 16;
+		p->src.y2 = p->surf.base.height << 16;
+
+		/* video gets half the screen's width, the plane does the scaling */
+		w = p->surf.base.width;
+		h = p->surf.base.height;
+		if (p->surf.video) {
+			w = c->dispw / 2;
+			h = min(w * video_h / video_w, c->disph);
+		}
 
-	p->src.x1 = 0 << 16;
-	p->src.y1 = 0 << 16;
-	p->src.x2 = p->surf.base.width << 16;
-	p->src.y2 = p->surf.base.height << 16;
+		/* fanned out so the stacking shows */
+		p->dst.x1 = i * 64;
+		p->dst.y1 = i * 64;
+		p->dst.x2 = p->dst.x1 + w;
+		p->dst.y2 = p->dst.y1 + h;
 
-	p->dst.x1 = 0;
-	p->dst.y1 = 0;
-	p->dst.x2 = p->surf.base.width;
-	p->dst.y2 = p->surf.base.height;
+		p->dirty = true;
+	}
 
-	if (!my_surface_alloc(&c->primary->surf, gbm,
-			DRM_FORMAT_XRGB8888, c->dispw, c->disph, dpy))
+	if (!my_surface_alloc(&c->primary->surf, my_ctx->fd, gbm,
+			c->primary->format, c->dispw, c->disph,
+			c->primary->modifiers, c->primary->count_modifiers, dpy))
 		return false;
+	print_layout(c->primary);
 
 	c->primary->dirty = true;
-	p->dirty = true;
 
-	if (produce_frame(dpy, ctx, p))
-		plane_commit(my_ctx, p);
+	if (produce_frame(dpy, ctx, c))
+		crtc_commit(my_ctx, c);
 
 	return true;
 }
 
-static bool animate_crtc(struct my_ctx *my_ctx,
-			 EGLDisplay dpy,
-			 EGLContext ctx,
-			 struct my_crtc *c, struct my_plane *p)
+static void animate_plane(struct my_crtc *c, struct my_plane *p, float steps)
 {
 	int w, h, x, y;
 
-	if (get_free_buffer(&c->primary->surf) < 0 ||
-			get_free_buffer(&p->surf) < 0)
-		return false;
-
 	switch (anim_mode) {
 		float rad, ang;
 	case ANIM_CURVE:
-		rad = adjust_radius(p);
-		ang = adjust_angle(p);
-		w = adjust_w(p);
-		h = adjust_h(p);
+		rad = adjust_radius(p, steps);
+		ang = adjust_angle(p, steps);
+		w = adjust_w(p, steps);
+		h = adjust_h(p, steps);
 		if (w < 4)
 			w = 4;
 		if (h < 4)
@@ -908,9 +1929,14 @@ static bool animate_crtc(struct my_ctx *my_ctx,
 		break;
 	}
 
-	/* no scaling: */
-	w = p->surf.base.width;
-	h= p->surf.base.height;
+	/* no scaling, but for video which keeps the size it was given */
+	if (p->surf.video) {
+		w = p->dst.x2 - p->dst.x1;
+		h = p->dst.y2 - p->dst.y1;
+	} else {
+		w = p->surf.base.width;
+		h = p->surf.base.height;
+	}
 
 	/* don't go off screen: */
 	x = min(x, c->primary->surf.base.width - w);
@@ -921,24 +1947,231 @@ static bool animate_crtc(struct my_ctx *my_ctx,
 	p->dst.x2 = p->dst.x1 + w;
 	p->dst.y2 = p->dst.y1 + h;
 	p->dirty = true;
+}
+
+/* whether a new frame of the plane would look any different */
+static bool plane_content_changes(const struct my_plane *p)
+{
+	/* GL content animates by the clock, and video always moves */
+	return render && (p->surf.gl || p->surf.video);
+}
+
+static bool animate_crtc(struct my_ctx *my_ctx,
+			 EGLDisplay dpy,
+			 EGLContext ctx,
+			 struct my_crtc *c)
+{
+	bool changed = c->dirty_mode || c->dirty_vrr;
+	uint64_t now;
+	float steps;
+	int i;
+
+	for (i = 0; i < crtc_count_planes(c); i++) {
+		if (get_free_buffer(c, &crtc_plane(c, i)->surf) < 0)
+			return false;
+	}
+
+	/* motion goes by the clock, in 60Hz frames, not by flips */
+	now = stats_now();
+	steps = c->anim_time ? (now - c->anim_time) / (1000000000.0f / 60.0f) : 1.0f;
+	steps = min(steps, 6.0f);
+	c->anim_time = now;
+
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *p = &c->overlays[i];
+		struct region dst = p->dst;
+
+		animate_plane(c, p, steps);
+		changed |= memcmp(&dst, &p->dst, sizeof dst) != 0;
+	}
+
+	for (i = 0; i < crtc_count_planes(c); i++)
+		changed |= plane_content_changes(crtc_plane(c, i));
+
+	/*
+	 * Nothing new to show, so with VRR there's nothing to present
+	 * and the panel can drop to its minimum refresh rate.
+	 */
+	c->idle = c->vrr && !changed;
+	if (c->idle)
+		return false;
 
 	c->primary->dirty = true;
 
-	produce_frame(dpy, ctx, p);
-	plane_commit(my_ctx, p);
+	/* no frame, so nothing to flip: try again straight away */
+	if (!produce_frame(dpy, ctx, c))
+		return true;
+
+	crtc_commit(my_ctx, c);
 
 	c->frames++;
 
-	if (c->frames >= 1000) {
-		struct timespec cur;
-		clock_gettime(CLOCK_MONOTONIC, &cur);
-		struct timespec diff = cur;
-		tp_sub(&diff, &c->prev);
-		float secs = (float) diff.tv_sec + diff.tv_nsec / 1000000000.0f;
+	return true;
+}
+
+static void move_overlays(struct my_crtc *c, int dx1, int dy1, int dx2, int dy2)
+{
+	int i;
+
+	for (i = 0; i < c->count_overlays; i++) {
+		struct my_plane *p = &c->overlays[i];
+
+		p->dst.x1 += dx1;
+		p->dst.y1 += dy1;
+		p->dst.x2 += dx2;
+		p->dst.y2 += dy2;
+		p->dirty = true;
+	}
+
+	c->primary->dirty = true;
+}
+
+static void reset_stats(struct my_crtc *c, int count_crtcs)
+{
+	uint64_t now = stats_now();
+	int i;
+
+	for (i = 0; i < count_crtcs; i++) {
+		hist_reset(&c[i].stats.commit);
+		hist_reset(&c[i].stats.render);
+		hist_reset(&c[i].stats.swap);
+		flip_counters_reset(&c[i].stats.flip);
+		c[i].stats.async = 0;
+		c[i].stats.async_rejected = 0;
+		c[i].stats.queued = 0;
+		c[i].stats.superseded = 0;
+		c[i].prev = now;
+		c[i].frames = 0;
+	}
+}
+
+static void print_stats(struct my_crtc *c, int count_crtcs)
+{
+	uint64_t now = stats_now();
+	int i;
+
+	for (i = 0; i < count_crtcs; i++) {
+		float secs = (now - c[i].prev) / 1000000000.0f;
+		struct flip_counters fc;
+
+		crtc_counters(&c[i], &fc);
+
 		printf("crtc [%d] id = %u: %u frames in %f secs, %f fps\n",
-		       c->base.crtc_idx, c->base.crtc_id, c->frames, secs, c->frames / secs);
-		c->prev = cur;
-		c->frames = 0;
+		       c[i].base.crtc_idx, c[i].base.crtc_id, c[i].frames, secs,
+		       secs > 0.0f ? c[i].frames / secs : 0.0f);
+		hist_print("commit", &c[i].stats.commit);
+		hist_print("render", &c[i].stats.render);
+		hist_print("swap", &c[i].stats.swap);
+		printf("  flips    n=%llu missed vblanks=%llu\n",
+		       (unsigned long long) fc.flips, (unsigned long long) fc.missed);
+		if (async_flip)
+			printf("  async    n=%u rejected=%u\n",
+			       c[i].stats.async, c[i].stats.async_rejected);
+		printf("  queued   n=%u superseded=%u\n",
+		       c[i].stats.queued, c[i].stats.superseded);
+		hist_print("interval", &fc.interval);
+		hist_print("jitter", &fc.jitter);
+		hist_print("latency", &fc.latency);
+	}
+}
+
+static double cpu_secs(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+static void write_report(FILE *f, struct my_crtc *c, int count_crtcs,
+			 const struct rusage *ru)
+{
+	uint64_t now = stats_now();
+	double secs = count_crtcs ? (now - c[0].prev) / 1000000000.0 : 0.0;
+	double user = cpu_secs(&ru->ru_utime);
+	double sys = cpu_secs(&ru->ru_stime);
+	int i, j;
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"duration_s\": %.3f,\n", secs);
+	fprintf(f, "  \"cpu\": { \"user_s\": %.3f, \"sys_s\": %.3f, \"percent\": %.1f },\n",
+		user, sys, secs > 0.0 ? (user + sys) * 100.0 / secs : 0.0);
+	fprintf(f, "  \"config\": { \"api\": \"%s\", \"anim\": \"%s\", \"blur\": %s, \"throttle\": %s, "
+		"\"render\": %s, \"explicit_sync\": %s, \"vrr\": %s, \"async\": %s, \"mailbox\": %s, "
+		"\"depth\": %u, \"modifiers\": %s, "
+		"\"primary_format\": \"%s\", \"overlay_format\": \"%s\", \"video\": \"%s\" },\n",
+		legacy ? "legacy" : "atomic",
+		anim_names[anim_mode],
+		blur ? "true" : "false",
+		throttle ? "true" : "false",
+		render ? "true" : "false",
+		explicit_sync ? "true" : "false",
+		vrr ? "true" : "false",
+		async_flip ? "true" : "false",
+		mailbox ? "true" : "false",
+		swap_depth,
+		fb_modifiers ? "true" : "false",
+		primary_format->name, overlay_format->name,
+		!video_w ? "none" : video_fd >= 0 ? "udmabuf" : "dumb");
+	fprintf(f, "  \"crtcs\": [\n");
+
+	for (i = 0; i < count_crtcs; i++) {
+		struct flip_counters fc;
+
+		crtc_counters(&c[i], &fc);
+
+		fprintf(f, "    {\n");
+		fprintf(f, "      \"crtc_id\": %u,\n", c[i].base.crtc_id);
+		fprintf(f, "      \"connector_id\": %u,\n", c[i].base.connector_id);
+		fprintf(f, "      \"mode\": \"%s\",\n", c[i].mode.name);
+		fprintf(f, "      \"vrefresh\": %u,\n", c[i].mode.vrefresh);
+		fprintf(f, "      \"vrr\": %s,\n", c[i].vrr ? "true" : "false");
+		fprintf(f, "      \"overlays\": %d,\n", c[i].count_overlays);
+		fprintf(f, "      \"frames\": %u,\n", c[i].frames);
+		fprintf(f, "      \"fps\": %.3f,\n", secs > 0.0 ? c[i].frames / secs : 0.0);
+		fprintf(f, "      \"flips\": %llu,\n", (unsigned long long) fc.flips);
+		fprintf(f, "      \"missed_vblanks\": %llu,\n", (unsigned long long) fc.missed);
+		fprintf(f, "      \"async_flips\": %u,\n", c[i].stats.async);
+		fprintf(f, "      \"async_rejected\": %u,\n", c[i].stats.async_rejected);
+		fprintf(f, "      \"queued\": %u,\n", c[i].stats.queued);
+		fprintf(f, "      \"superseded\": %u,\n", c[i].stats.superseded);
+		fprintf(f, "      \"layouts\": [");
+		for (j = 0; j < crtc_count_planes(&c[i]); j++) {
+			fprintf(f, "%s\"0x%016llx\"", j ? ", " : "",
+				(unsigned long long) crtc_plane(&c[i], j)->surf.base.buffers[0].modifier);
+		}
+		fprintf(f, "],\n");
+		fprintf(f, "      ");
+		hist_json(f, "commit", &c[i].stats.commit);
+		fprintf(f, ",\n      ");
+		hist_json(f, "render", &c[i].stats.render);
+		fprintf(f, ",\n      ");
+		hist_json(f, "swap", &c[i].stats.swap);
+		fprintf(f, ",\n      ");
+		hist_json(f, "interval", &fc.interval);
+		fprintf(f, ",\n      ");
+		hist_json(f, "jitter", &fc.jitter);
+		fprintf(f, ",\n      ");
+		hist_json(f, "latency", &fc.latency);
+		fprintf(f, "\n    }%s\n", i + 1 < count_crtcs ? "," : "");
+	}
+
+	fprintf(f, "  ]\n");
+	fprintf(f, "}\n");
+}
+
+static bool bench_done(struct my_crtc *c, int count_crtcs,
+		       double secs, unsigned int frames)
+{
+	int i;
+
+	if (secs > 0.0 && (stats_now() - c[0].prev) / 1000000000.0 >= secs)
+		return true;
+
+	if (!frames)
+		return false;
+
+	/* an idle VRR output has no more frames coming */
+	for (i = 0; i < count_crtcs; i++) {
+		if (c[i].frames < frames && !c[i].idle)
+			return false;
 	}
 
 	return true;
@@ -946,154 +2179,476 @@ static bool animate_crtc(struct my_ctx *my_ctx,
 
 static void usage(const char *name)
 {
-	fprintf(stderr, "Usage: %s <connector> <mode> [[<connector> <mode>] ...]\n",
+	fprintf(stderr, "Usage: %s [options] <connector> <mode> [[<connector> <mode>] ...]\n"
+		"  -D <dev>     scanout device: a /dev/dri node or driver name (default: first\n"
+		"               one that can drive a display)\n"
+		"  -r <dev>     render device, if not the scanout one; buffers are shared\n"
+		"               with the scanout device as dma-bufs\n"
+		"  -l           list DRM devices and exit\n"
+		"  -L           legacy SetCrtc/SetPlane/PageFlip instead of atomic commits\n"
+		"  -A           async (tearing) flips, where the driver takes them\n"
+		"  -M           mailbox: render ahead, only the newest frame gets shown\n"
+		"  -s <depth>   buffers per surface: 2, 3 or 4 (default 4)\n"
+		"  -I           implicit buffer layouts, no format modifiers\n"
+		"  -p <format>  primary plane format: XRGB8888, ARGB8888, XRGB2101010,\n"
+		"               RGB565 or NV12 (default XRGB8888)\n"
+		"  -o <format>  overlay plane format, as for -p, or YUV420 with -v\n"
+		"  -v <w>x<h>   overlays play CPU-written video of this size, scaled to half\n"
+		"               the screen by the plane; NV12 (default) or YUV420\n"
+		"  -i <file>    with -v, play raw frames of the overlay format from <file>,\n"
+		"               imported as udmabufs with no copy (needs /dev/udmabuf)\n"
+		"  -e           explicit sync (IN_FENCE_FD/OUT_FENCE_PTR)\n"
+		"  -O <n>       overlay planes per crtc, as many as the hardware takes (default 1)\n"
+		"  -V           variable refresh rate, on displays that can do it\n"
+		"  -F <spec>    use a fake in-process device instead of a real DRM device,\n"
+		"               without GL; <spec> is e.g.\n"
+		"               crtcs=2,connectors=2,planes=4,hz=60,latency=0\n"
+		"               (use - for the defaults)\n"
+		"\n"
+		"benchmark mode (no tty needed):\n"
+		"  -b <file>    run non-interactively, write a JSON report to <file> ('-' for stdout)\n"
+		"  -d <secs>    run for <secs> seconds (default 10)\n"
+		"  -n <frames>  run until every crtc has produced <frames> frames\n"
+		"  -a <anim>    animation: curve, rand or static\n"
+		"  -B           blur\n"
+		"  -U           don't throttle to the flip rate\n"
+		"  -R           don't render\n",
 		name);
 }
 
 int main(int argc, char *argv[])
 {
 	struct my_ctx my_ctx = {};
-	struct my_crtc c[8] = {
-		[0] = {
-		},
-	};
-	struct my_plane p[8] = {
-		[0] = {
-			.state = {
-				.ang = 0.0f,
-				.rad_dir = 1.0f,
-				.rad = 0.0f,
-				.w_dir = 1,
-				.w = 0,
-				.h_dir = 1,
-				.h = 0,
-			},
+	static const struct my_plane plane_template = {
+		.state = {
+			.ang = 0.0f,
+			.rad_dir = 1.0f,
+			.rad = 0.0f,
+			.w_dir = 1,
+			.w = 0,
+			.h_dir = 1,
+			.h = 0,
 		},
 	};
-	struct my_plane primary[8] = {
-			[0] = {
-			},
-	};
+	struct my_crtc *c;
+	struct my_plane *primary;
 	struct ctx uctx = {};
 	int fd;
 	bool enable = true;
 	bool quit = false;
 	int r;
-	int i;
-	struct gbm_device *gbm;
+	int i, j;
+	struct gbm_device *gbm = NULL;
 	drmEventContext evtctx = {
 		.version = DRM_EVENT_CONTEXT_VERSION,
-#ifndef LEGACY_API
-		.page_flip_handler = page_flip_event,
-#endif
+		.page_flip_handler2 = page_flip_event,
 	};
-	EGLDisplay dpy;
-	EGLContext ctx;
+	EGLDisplay dpy = EGL_NO_DISPLAY;
+	EGLContext ctx = EGL_NO_CONTEXT;
 	EGLint major, minor;
 	EGLint num_configs = 0;
 	EGLConfig config;
 	int count_crtcs = 0;
-	const char *modes[8] = {};
+	bool unthrottled = false;
+	const char **modes;
+	struct output *outputs;
+	int count_outputs;
+	const char *bench_file = NULL;
+	const char *fake_spec = NULL;
+	const char *video_file = NULL;
+	const char *scanout_dev = NULL;
+	const char *render_dev = NULL;
+	int render_fd = -1;
+	double bench_secs = 0.0;
+	unsigned int bench_frames = 0;
+	const struct format_info *info;
+	int opt;
+
+	primary_format = format_lookup(DRM_FORMAT_XRGB8888);
+
+	while ((opt = getopt(argc, argv, "D:r:lLAMs:Ip:o:v:i:eO:VF:b:d:n:a:BUR")) != -1) {
+		switch (opt) {
+		case 'b':
+			bench_file = optarg;
+			throttle = true;
+			break;
+		case 'd':
+			bench_secs = atof(optarg);
+			break;
+		case 'n':
+			bench_frames = atoi(optarg);
+			break;
+		case 'a':
+			for (i = 0; i < ANIM_COUNT; i++) {
+				if (!strcmp(optarg, anim_names[i]))
+					break;
+			}
+			if (i == ANIM_COUNT) {
+				usage(argv[0]);
+				return 1;
+			}
+			anim_mode = i;
+			break;
+		case 'B':
+			blur = true;
+			break;
+		case 'U':
+			unthrottled = true;
+			break;
+		case 'R':
+			render = false;
+			break;
+		case 'D':
+			scanout_dev = optarg;
+			break;
+		case 'r':
+			render_dev = optarg;
+			break;
+		case 'l':
+			list_devices();
+			return 0;
+		case 'L':
+			legacy = true;
+			break;
+		case 'A':
+			async_flip = true;
+			break;
+		case 'M':
+			mailbox = true;
+			break;
+		case 's':
+			swap_depth = atoi(optarg);
+			if (swap_depth < 2 || swap_depth > SURFACE_MAX_DEPTH) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'I':
+			fb_modifiers = false;
+			break;
+		case 'p':
+		case 'o':
+			info = format_lookup_name(optarg);
+			if (!info) {
+				usage(argv[0]);
+				return 1;
+			}
+			if (opt == 'p')
+				primary_format = info;
+			else
+				overlay_format = info;
+			break;
+		case 'v':
+			if (sscanf(optarg, "%ux%u", &video_w, &video_h) != 2 ||
+			    !video_w || !video_h || video_w & 1 || video_h & 1) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'i':
+			video_file = optarg;
+			break;
+		case 'e':
+			explicit_sync = true;
+			break;
+		case 'O':
+			count_overlays = atoi(optarg);
+			if (count_overlays < 0)
+				count_overlays = 0;
+			break;
+		case 'V':
+			vrr = true;
+			break;
+		case 'F':
+			fake_spec = strcmp(optarg, "-") ? optarg : "";
+			kms = &kms_fake;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!overlay_format)
+		overlay_format = format_lookup(video_w ? DRM_FORMAT_NV12 : DRM_FORMAT_XRGB8888);
+
+	/*
+	 * Frames from a file can be in any format, made up ones are only
+	 * ever YUV, and GL can't draw YUV420's three planes.
+	 */
+	if (primary_format->count_planes > 2 ||
+	    (video_file && !video_w) ||
+	    (video_w && !video_file && !format_is_yuv(overlay_format)) ||
+	    (!video_w && overlay_format->count_planes > 2)) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (video_file) {
+		struct stat st;
+
+		video_fd = open(video_file, O_RDONLY | O_CLOEXEC);
+		if (video_fd < 0 || fstat(video_fd, &st)) {
+			printf("can't open %s: %s\n", video_file, strerror(errno));
+			return 15;
+		}
+
+		video_frames = st.st_size / video_frame_size(overlay_format, video_w, video_h);
+		if (!video_frames) {
+			printf("%s is shorter than one %ux%u %s frame\n", video_file,
+			       video_w, video_h, overlay_format->name);
+			return 15;
+		}
+	}
 
-	if (argc < 3) {
+	if (argc - optind < 2) {
 		usage(argv[0]);
 		return 1;
 	}
 
-	fd = drmOpen("msm", NULL);
+	if (bench_file) {
+		if (unthrottled)
+			throttle = false;
+		if (bench_secs <= 0.0 && !bench_frames)
+			bench_secs = 10.0;
+	}
+
+	fd = kms->open(fake_spec ? fake_spec : scanout_dev);
 	if (fd < 0)
 		return 2;
 
 	/* request universal planes: */
-	drmSetClientCap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	kms->set_client_cap(fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
+	/* the legacy path still wants the atomic properties to look at */
+	if (kms->set_client_cap(fd, DRM_CLIENT_CAP_ATOMIC, 1) && !legacy)
+		return 2;
 
 	if (!init_ctx(&uctx, fd))
 		return 3;
 
-	for (i = 0; i < argc - 2; i += 2) {
-		if (count_crtcs) {
-			c[count_crtcs] = c[0];
-			p[count_crtcs] = p[0];
-			primary[count_crtcs] = primary[0];
-		}
-
-		init_crtc(&c[count_crtcs].base, &uctx);
-		init_plane(&p[count_crtcs].base, &c[count_crtcs].base, &uctx);
-		init_plane(&primary[count_crtcs].base, &c[count_crtcs].base, &uctx);
-
-		if (pick_connector(&c[count_crtcs].base, argv[i + 1]) &&
-				pick_encoder(&c[count_crtcs].base) &&
-				pick_crtc(&c[count_crtcs].base) &&
-				pick_plane(&p[count_crtcs].base, -1) &&
-				pick_plane(&primary[count_crtcs].base, c[count_crtcs].base.crtc_id)) {
-			modes[count_crtcs] = argv[i + 2];
-			c[count_crtcs].primary = &primary[count_crtcs];
-			count_crtcs++;
-			continue;
+	/* one of everything per <connector> <mode> pair */
+	count_outputs = (argc - optind) / 2;
+	c = calloc(count_outputs, sizeof *c);
+	primary = calloc(count_outputs, sizeof *primary);
+	modes = calloc(count_outputs, sizeof *modes);
+	outputs = calloc(count_outputs, sizeof *outputs);
+	if (!c || !primary || !modes || !outputs)
+		return 11;
+
+	for (i = optind; i + 1 < argc; i += 2) {
+		struct my_crtc *mc = &c[count_crtcs];
+		struct output *o = &outputs[count_crtcs];
+
+		init_crtc(&mc->base, &uctx);
+		init_plane(&primary[count_crtcs].base, &mc->base, &uctx);
+
+		mc->overlays = calloc(count_overlays, sizeof *mc->overlays);
+		o->overlays = calloc(count_overlays, sizeof *o->overlays);
+		if (count_overlays && (!mc->overlays || !o->overlays))
+			return 11;
+
+		for (j = 0; j < count_overlays; j++) {
+			mc->overlays[j] = plane_template;
+			/* spread out along the curve instead of on top of each other */
+			mc->overlays[j].state.ang = j * 2.0f * M_PI / count_overlays;
+			init_plane(&mc->overlays[j].base, &mc->base, &uctx);
+			o->overlays[j] = &mc->overlays[j].base;
 		}
 
-		release_plane(&primary[count_crtcs].base);
-		release_plane(&p[count_crtcs].base);
-		release_crtc(&c[count_crtcs].base);
-		release_encoder(&c[count_crtcs].base);
-		release_connector(&c[count_crtcs].base);
+		o->name = argv[i];
+		o->mode = argv[i + 1];
+		o->crtc = &mc->base;
+		o->primary = &primary[count_crtcs].base;
+		o->count_overlays = count_overlays;
+		o->overlay_format = overlay_format->format;
+
+		modes[count_crtcs] = argv[i + 1];
+		c[count_crtcs].primary = &primary[count_crtcs];
+		c[count_crtcs].fence.next = 1;
+		c[count_crtcs].fence.last = 0;
+		c[count_crtcs].fence.completed = 0;
+		c[count_crtcs].fence.flipped = 0;
+		count_crtcs++;
 	}
 
-	if (count_crtcs == 0) {
+	if (!pick_outputs(&uctx, outputs, count_crtcs)) {
 		usage(argv[0]);
 		return 4;
 	}
 
-	gbm = gbm_create_device(fd);
-	if (!gbm)
-		return 5;
+	for (i = 0; i < count_crtcs; i++)
+		c[i].count_overlays = outputs[i].count_overlays;
+
+	/*
+	 * The fake device has no memory to render into, but can still
+	 * take buffers from a real render device.
+	 */
+	if (render_dev) {
+		render_fd = open_device(render_dev, DRM_NODE_RENDER);
+		if (render_fd < 0)
+			return 2;
+	} else if (!fake_spec) {
+		render_fd = fd;
+	}
+
+	if (render_fd >= 0) {
+		gbm = gbm_create_device(render_fd);
+		if (!gbm)
+			return 5;
+
+		dpy = eglGetDisplay(gbm);
+		if (dpy == EGL_NO_DISPLAY)
+			return 6;
 
-	dpy = eglGetDisplay(gbm);
-	if (dpy == EGL_NO_DISPLAY)
-		return 6;
+		if (!eglInitialize(dpy, &major, &minor))
+			return 7;
 
-	if (!eglInitialize(dpy, &major, &minor))
-		return 7;
+		eglBindAPI(EGL_OPENGL_API);
 
-	eglBindAPI(EGL_OPENGL_API);
+		if (!eglChooseConfig(dpy, attribs, &config, 1, &num_configs) || num_configs != 1)
+			return 8;
 
-	if (!eglChooseConfig(dpy, attribs, &config, 1, &num_configs) || num_configs != 1)
-		return 8;
+		ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
+		if (!ctx)
+			return 9;
 
-	ctx = eglCreateContext(dpy, config, EGL_NO_CONTEXT, NULL);
-	if (!ctx)
-		return 9;
+		eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
 
-	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
+		gl_init();
 
-	gl_init();
+		if (!gl_image_init(dpy)) {
+			printf("no EGL_EXT_image_dma_buf_import\n");
+			return 13;
+		}
+
+		if (explicit_sync && !gl_fence_init(dpy)) {
+			printf("no EGL_ANDROID_native_fence_sync, using implicit sync\n");
+			explicit_sync = false;
+		}
+	}
 
 	my_ctx.fd = fd;
-	my_ctx.planes = p;
+	my_ctx.crtcs = c;
 	my_ctx.count_crtcs = count_crtcs;
+	my_ctx.req = kms->atomic_alloc();
+	if (!my_ctx.req)
+		return 11;
+	my_ctx.flags = DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_NONBLOCK;
+
+	if (legacy && explicit_sync) {
+		printf("no fences with the legacy API, using implicit sync\n");
+		explicit_sync = false;
+	}
+	if (legacy && vrr) {
+		printf("no VRR with the legacy API, using fixed refresh\n");
+		vrr = false;
+	}
+	if (async_flip) {
+		uint64_t cap = 0;
+
+		kms->get_cap(fd, legacy ? DRM_CAP_ASYNC_PAGE_FLIP :
+			     DRM_CAP_ATOMIC_ASYNC_PAGE_FLIP, &cap);
+		if (!cap) {
+			printf("no async page flips, flipping on vblank\n");
+			async_flip = false;
+		}
+	}
+
+	if (fb_modifiers) {
+		uint64_t cap = 0;
+
+		kms->get_cap(fd, DRM_CAP_ADDFB2_MODIFIERS, &cap);
+		if (!cap) {
+			printf("no fb modifiers, using implicit layouts\n");
+			fb_modifiers = false;
+		} else if (gbm && !gl_image_modifiers(dpy)) {
+			printf("no EGL_EXT_image_dma_buf_import_modifiers, using implicit layouts\n");
+			fb_modifiers = false;
+		}
+	}
 
 	for (i = 0; i < count_crtcs; i++) {
-		populate_crtc_props(fd, &c[i]);
-		populate_plane_props(fd, &p[i]);
-		populate_plane_props(fd, &primary[i]);
-		plane_enable(&p[i], enable);
-		plane_enable(&primary[i], true);
-		if (!handle_crtc(&my_ctx, gbm, dpy, ctx, modes[i], &c[i], &p[i]))
+		populate_crtc_props(&uctx, &c[i]);
+		c[i].out_fence_fd = -1;
+		c[i].next_out_fence_fd = -1;
+		if (!legacy &&
+		    (!c[i].prop.mode_id || !c[i].prop.active || !c[i].prop.connector_crtc_id)) {
+			printf("no MODE_ID/ACTIVE/CRTC_ID properties for crtc id = %u\n",
+			       c[i].base.crtc_id);
+			return 12;
+		}
+		if (vrr) {
+			if (c[i].vrr_capable && c[i].prop.vrr_enabled) {
+				c[i].vrr = true;
+				c[i].dirty_vrr = true;
+			} else {
+				printf("no VRR on crtc id = %u, using fixed refresh\n",
+				       c[i].base.crtc_id);
+			}
+		}
+		if (explicit_sync && !c[i].prop.out_fence_ptr) {
+			printf("no fence properties, using implicit sync\n");
+			explicit_sync = false;
+		}
+		for (j = 0; j < crtc_count_planes(&c[i]); j++) {
+			struct my_plane *p = crtc_plane(&c[i], j);
+
+			populate_plane_props(&uctx, p);
+			p->format = j ? overlay_format->format : primary_format->format;
+			if (!plane_has_format(&uctx.plane_caps[p->base.plane_idx], p->format,
+					      DRM_FORMAT_MOD_INVALID)) {
+				printf("plane id = %u can't scan out %s\n", p->base.plane_id,
+				       format_lookup(p->format)->name);
+				return 14;
+			}
+			plane_pick_modifiers(&uctx, p, p->format);
+			if (explicit_sync && !p->prop.in_fence_fd) {
+				printf("no fence properties, using implicit sync\n");
+				explicit_sync = false;
+			}
+			plane_enable(p, p == c[i].primary || enable);
+		}
+		assign_zpos(&uctx, &c[i]);
+		capture_original(&uctx, &c[i]);
+		if (!handle_crtc(&my_ctx, gbm, dpy, ctx, modes[i], &c[i]))
 			return 10;
 	}
+
+	/*
+	 * Not every combination of planes the matching came up with can be
+	 * scanned out at once, so check with the kernel and shed overlays
+	 * until it agrees.
+	 */
+	while (!test_state(&my_ctx) && drop_overlay(&my_ctx, dpy)) {
+		for (i = 0; i < count_crtcs; i++) {
+			if (produce_frame(dpy, ctx, &c[i]))
+				crtc_commit(&my_ctx, &c[i]);
+		}
+	}
 	commit_state(&my_ctx);
 
-	term_init();
+	if (!bench_file)
+		term_init();
 
 	srand(time(NULL));
 
 	bool test_running = false;
-	struct timespec prev;
+
+	reset_stats(c, count_crtcs);
 
 	struct timeval timeout;
+	struct timeval idle;
 	struct timeval *t = NULL;
+	struct rusage ru_start;
+
+	if (bench_file) {
+		getrusage(RUSAGE_SELF, &ru_start);
+		test_running = true;
+		t = &timeout;
+	}
 
 	while (!quit) {
+		struct timeval *wait = t;
 		char cmd;
 		fd_set fds;
 		int maxfd;
@@ -1101,17 +2656,30 @@ int main(int argc, char *argv[])
 		FD_ZERO(&fds);
 
 		maxfd = STDIN_FILENO;
-		FD_SET(STDIN_FILENO, &fds);
+		if (!bench_file)
+			FD_SET(STDIN_FILENO, &fds);
 
 		maxfd = max(maxfd, fd);
 		FD_SET(fd, &fds);
 
+		for (i = 0; i < count_crtcs; i++) {
+			if (c[i].out_fence_fd < 0)
+				continue;
+			maxfd = max(maxfd, c[i].out_fence_fd);
+			FD_SET(c[i].out_fence_fd, &fds);
+		}
+
 		if (t) {
 			t->tv_sec = 0;
 			t->tv_usec = 0;
+		} else if (bench_file) {
+			/* don't hang the benchmark if the display stalls */
+			idle.tv_sec = 0;
+			idle.tv_usec = 100000;
+			wait = &idle;
 		}
 
-		r = select(maxfd + 1, &fds, NULL, NULL, t);
+		r = select(maxfd + 1, &fds, NULL, NULL, wait);
 
 		if (r < 0 && errno == EINTR)
 			continue;
@@ -1119,7 +2687,15 @@ int main(int argc, char *argv[])
 		if (FD_ISSET(fd, &fds)) {
 			if (test_running)
 				t = &timeout;
-			drmHandleEvent(fd, &evtctx);
+			kms->handle_event(fd, &evtctx);
+		}
+
+		for (i = 0; i < count_crtcs; i++) {
+			if (c[i].out_fence_fd < 0 || !FD_ISSET(c[i].out_fence_fd, &fds))
+				continue;
+			if (test_running)
+				t = &timeout;
+			out_fence_event(&my_ctx, i);
 		}
 
 		if (t && test_running) {
@@ -1130,7 +2706,7 @@ int main(int argc, char *argv[])
 			 * free buffers, otherwise don't.
 			 */
 			for (i = 0; i < count_crtcs; i++)
-				no_sleep |= animate_crtc(&my_ctx, dpy, ctx, &c[i], &p[i]);
+				no_sleep |= animate_crtc(&my_ctx, dpy, ctx, &c[i]);
 			commit_state(&my_ctx);
 
 			if (no_sleep)
@@ -1139,6 +2715,9 @@ int main(int argc, char *argv[])
 				t = NULL;
 		}
 
+		if (bench_file && bench_done(c, count_crtcs, bench_secs, bench_frames))
+			break;
+
 		if (!FD_ISSET(STDIN_FILENO, &fds))
 			continue;
 
@@ -1149,9 +2728,10 @@ int main(int argc, char *argv[])
 		case 'o':
 			enable = !enable;
 			for (i = 0; i < count_crtcs; i++) {
-				plane_enable(&p[i], enable);
-				if (enable && produce_frame(dpy, ctx, &p[i]))
-					plane_commit(&my_ctx, &p[i]);
+				for (j = 0; j < c[i].count_overlays; j++)
+					plane_enable(&c[i].overlays[j], enable);
+				if (!enable || produce_frame(dpy, ctx, &c[i]))
+					crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
@@ -1161,46 +2741,40 @@ int main(int argc, char *argv[])
 		case 's':
 		case 'x':
 			for (i = 0; i < count_crtcs; i++) {
-				p[i].dst.y1 += (cmd == 's') ? -1 : 1;
-				p[i].dst.y2 += (cmd == 's') ? -1 : 1;
-				p[i].dirty = true;
-				c[i].primary->dirty = true;
-				if (produce_frame(dpy, ctx, &p[i]))
-					plane_commit(&my_ctx, &p[i]);
+				int d = (cmd == 's') ? -1 : 1;
+
+				move_overlays(&c[i], 0, d, 0, d);
+				if (produce_frame(dpy, ctx, &c[i]))
+					crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
 		case 'S':
 		case 'X':
 			for (i = 0; i < count_crtcs; i++) {
-				p[i].dst.y2 += (cmd == 'S') ? -1 : 1;
-				p[i].dirty = true;
-				c[i].primary->dirty = true;
-				if (produce_frame(dpy, ctx, &p[i]))
-					plane_commit(&my_ctx, &p[i]);
+				move_overlays(&c[i], 0, 0, 0, (cmd == 'S') ? -1 : 1);
+				if (produce_frame(dpy, ctx, &c[i]))
+					crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
 		case 'z':
 		case 'c':
 			for (i = 0; i < count_crtcs; i++) {
-				p[i].dst.x1 += (cmd == 'z') ? -1 : 1;
-				p[i].dst.x2 += (cmd == 'z') ? -1 : 1;
-				p[i].dirty = true;
-				c[i].primary->dirty = true;
-				if (produce_frame(dpy, ctx, &p[i]))
-					plane_commit(&my_ctx, &p[i]);
+				int d = (cmd == 'z') ? -1 : 1;
+
+				move_overlays(&c[i], d, 0, d, 0);
+				if (produce_frame(dpy, ctx, &c[i]))
+					crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
 		case 'Z':
 		case 'C':
 			for (i = 0; i < count_crtcs; i++) {
-				p[i].dst.x2 += (cmd == 'Z') ? -1 : 1;
-				p[i].dirty = true;
-				c[i].primary->dirty = true;
-				if (produce_frame(dpy, ctx, &p[i]))
-					plane_commit(&my_ctx, &p[i]);
+				move_overlays(&c[i], 0, 0, (cmd == 'Z') ? -1 : 1, 0);
+				if (produce_frame(dpy, ctx, &c[i]))
+					crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
@@ -1211,17 +2785,18 @@ int main(int argc, char *argv[])
 			 */
 			throttle |= true;
 			t = &timeout;
-			if (test_running) {
-				clock_gettime(CLOCK_MONOTONIC, &prev);
-				for (i = 0; i < count_crtcs; i++) {
-					c[i].prev = prev;
-					c[i].frames = 0;
-				}
-			}
+			if (test_running)
+				reset_stats(c, count_crtcs);
 			break;
 		case 'T':
 			throttle = !throttle;
 			break;
+		case 'm':
+			mailbox = !mailbox;
+			break;
+		case 'p':
+			print_stats(c, count_crtcs);
+			break;
 		case 'b':
 			blur = !blur;
 			break;
@@ -1239,34 +2814,56 @@ int main(int argc, char *argv[])
 			break;
 		case 'd':
 			for (i = 0; i < count_crtcs; i++) {
-				p[i].dirty = true;
-				c[i].primary->dirty = true;
-				plane_commit(&my_ctx, &p[i]);
+				move_overlays(&c[i], 0, 0, 0, 0);
+				crtc_commit(&my_ctx, &c[i]);
 			}
 			commit_state(&my_ctx);
 			break;
 		}
 	}
 
-	term_deinit();
-
-	for (i = 0; i < count_crtcs; i++) {
-		c[i].primary->dirty = true;
-		c[i].mode = c[i].original_mode;
-		c[i].dirty_mode = true;
-
-		plane_enable(&p[i], false);
-		plane_commit(&my_ctx, &p[i]);
+	if (bench_file) {
+		struct rusage ru_end, ru;
+		FILE *f = stdout;
+
+		getrusage(RUSAGE_SELF, &ru_end);
+		timersub(&ru_end.ru_utime, &ru_start.ru_utime, &ru.ru_utime);
+		timersub(&ru_end.ru_stime, &ru_start.ru_stime, &ru.ru_stime);
+
+		if (strcmp(bench_file, "-"))
+			f = fopen(bench_file, "w");
+		if (f) {
+			write_report(f, c, count_crtcs, &ru);
+			if (f != stdout)
+				fclose(f);
+		} else {
+			printf("can't write %s: %s\n", bench_file, strerror(errno));
+		}
+	} else {
+		term_deinit();
 
+		print_stats(c, count_crtcs);
 	}
+
+	/* this one has to land, so wait out any pending flip instead of EBUSY */
+	my_ctx.flags &= ~DRM_MODE_ATOMIC_NONBLOCK;
+	for (i = 0; i < count_crtcs; i++)
+		crtc_restore(&my_ctx, &c[i]);
 	commit_state(&my_ctx);
 
-	glUseProgram(0);
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	glBindTexture(GL_TEXTURE_2D, 0);
-	eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
+	if (!legacy)
+		printf("atomic: %u commits, request reached a new size %u times, %u after the first frame\n",
+		       my_ctx.dbg.commits, my_ctx.dbg.req_peaks, my_ctx.dbg.steady_req_peaks);
+	kms->atomic_free(my_ctx.req);
 
-	gl_fini();
+	if (gbm) {
+		glUseProgram(0);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		eglMakeCurrent(dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx);
+
+		gl_fini();
+	}
 
 	for (i = 0; i < count_crtcs; i++) {
 #if 0
@@ -1275,17 +2872,38 @@ int main(int argc, char *argv[])
 		gl_surf_fini(dpy, &p[i].surf);
 #endif
 		surface_free(&c[i].primary->surf.base);
-		surface_free(&p[i].surf.base);
+		for (j = 0; j < c[i].count_overlays; j++)
+			surface_free(&c[i].overlays[j].surf.base);
+
+		/* the kernel keeps its own reference for as long as it's on screen */
+		if (c[i].mode_blob)
+			kms->destroy_property_blob(fd, c[i].mode_blob);
 	}
 
-	eglDestroyContext(dpy, ctx);
-	eglTerminate(dpy);
+	if (gbm) {
+		eglDestroyContext(dpy, ctx);
+		eglTerminate(dpy);
+
+		gbm_device_destroy(gbm);
+	}
 
-	gbm_device_destroy(gbm);
+	if (render_fd >= 0 && render_fd != fd)
+		close(render_fd);
+	if (video_fd >= 0)
+		close(video_fd);
 
 	free_ctx(&uctx);
 
-	drmClose(fd);
+	for (i = 0; i < count_crtcs; i++) {
+		free(outputs[i].overlays);
+		free(c[i].overlays);
+	}
+	free(outputs);
+	free(modes);
+	free(primary);
+	free(c);
+
+	kms->close(fd);
 
 	return 0;
 }
@@ -0,0 +1,179 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+static unsigned int hist_idx(uint64_t val)
+{
+	unsigned int exp;
+
+	if (val < HIST_SUB_BUCKETS)
+		return val;
+
+	exp = 63 - __builtin_clzll(val);
+
+	return (exp - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS +
+		((val >> (exp - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1));
+}
+
+/* smallest value that lands in bucket idx */
+static uint64_t hist_val(unsigned int idx)
+{
+	unsigned int row = idx / HIST_SUB_BUCKETS;
+	unsigned int sub = idx % HIST_SUB_BUCKETS;
+
+	if (row == 0)
+		return sub;
+
+	return (uint64_t) (HIST_SUB_BUCKETS + sub) << (row - 1);
+}
+
+void hist_reset(struct histogram *h)
+{
+	memset(h, 0, sizeof *h);
+}
+
+void hist_add(struct histogram *h, uint64_t val)
+{
+	if (!h->count || val < h->min)
+		h->min = val;
+	if (val > h->max)
+		h->max = val;
+
+	h->count++;
+	h->sum += val;
+	h->buckets[hist_idx(val)]++;
+}
+
+uint64_t hist_percentile(const struct histogram *h, unsigned int pct)
+{
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (!h->count)
+		return 0;
+
+	target = (h->count * pct + 99) / 100;
+	if (!target)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen < target)
+			continue;
+
+		/* report the middle of the bucket, clamped to what we saw */
+		uint64_t val = h->max;
+		if (i + 1 < HIST_BUCKETS)
+			val = hist_val(i) + (hist_val(i + 1) - hist_val(i)) / 2;
+		if (val < h->min)
+			val = h->min;
+		if (val > h->max)
+			val = h->max;
+		return val;
+	}
+
+	return h->max;
+}
+
+void hist_print(const char *title, const struct histogram *h)
+{
+	if (!h->count) {
+		printf("  %-8s no samples\n", title);
+		return;
+	}
+
+	printf("  %-8s n=%llu avg=%.1f p50=%.1f p90=%.1f p99=%.1f max=%.1f usecs\n",
+	       title, (unsigned long long) h->count,
+	       h->sum / (double) h->count / 1000.0,
+	       hist_percentile(h, 50) / 1000.0,
+	       hist_percentile(h, 90) / 1000.0,
+	       hist_percentile(h, 99) / 1000.0,
+	       h->max / 1000.0);
+}
+
+/* writes "name": { ... } with all values in microseconds */
+void hist_json(FILE *f, const char *name, const struct histogram *h)
+{
+	fprintf(f, "\"%s\": { \"count\": %llu, \"avg_us\": %.3f, "
+		"\"p50_us\": %.3f, \"p90_us\": %.3f, \"p99_us\": %.3f, "
+		"\"max_us\": %.3f }",
+		name, (unsigned long long) h->count,
+		h->count ? h->sum / (double) h->count / 1000.0 : 0.0,
+		hist_percentile(h, 50) / 1000.0,
+		hist_percentile(h, 90) / 1000.0,
+		hist_percentile(h, 99) / 1000.0,
+		h->max / 1000.0);
+}
+
+void flip_counters_reset(struct flip_counters *fc)
+{
+	memset(fc, 0, sizeof *fc);
+}
+
+/*
+ * seq/ts are from the flip event and target is the vblank the flip was
+ * committed for, period is the refresh period of the mode, and start
+ * is when the frame that just reached the screen started being
+ * produced.  target, period and start are 0 if unknown.
+ */
+void flip_counters_add(struct flip_counters *fc, unsigned int seq,
+		       uint64_t target, uint64_t ts, uint64_t period,
+		       uint64_t start)
+{
+	/* the event only has the low 32 bits of the sequence */
+	if (target && (int) (seq - (unsigned int) target) > 0)
+		fc->missed += seq - (unsigned int) target;
+
+	if (fc->flips) {
+		unsigned int vblanks = seq - fc->last_seq;
+
+		hist_add(&fc->interval, ts - fc->last_ts);
+
+		if (period && vblanks) {
+			uint64_t expected = fc->last_ts + vblanks * period;
+
+			hist_add(&fc->jitter, ts > expected ? ts - expected : expected - ts);
+		}
+	}
+
+	if (start && start < ts)
+		hist_add(&fc->latency, ts - start);
+
+	fc->flips++;
+	fc->last_seq = seq;
+	fc->last_ts = ts;
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
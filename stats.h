@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear histogram of nanosecond values: one row per power of two,
+ * split linearly into HIST_SUB_BUCKETS.  Adding a sample is a couple of
+ * shifts and an increment, and the resolution stays within 1/8th of the
+ * value from nanoseconds up to hours.
+ */
+#define HIST_SUB_BITS		3
+#define HIST_SUB_BUCKETS	(1 << HIST_SUB_BITS)
+#define HIST_BUCKETS		((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+void hist_reset(struct histogram *h);
+void hist_add(struct histogram *h, uint64_t val);
+uint64_t hist_percentile(const struct histogram *h, unsigned int pct);
+void hist_print(const char *title, const struct histogram *h);
+void hist_json(FILE *f, const char *name, const struct histogram *h);
+
+/*
+ * What the page flip events of one CRTC tell us.  A flip that lands
+ * after the vblank it was committed for means frames were missed, and
+ * jitter is how far the flip timestamp is from where the mode's refresh
+ * period says it should have been.  Gaps with nothing committed, on a
+ * throttled or idle output or a stretched VRR refresh, aren't misses.
+ */
+struct flip_counters {
+	uint64_t flips;
+	uint64_t missed;
+	unsigned int last_seq;
+	uint64_t last_ts;
+	struct histogram interval;
+	struct histogram jitter;
+	struct histogram latency;	/* frame start to scanout */
+};
+
+void flip_counters_reset(struct flip_counters *fc);
+void flip_counters_add(struct flip_counters *fc, unsigned int seq,
+		       uint64_t target, uint64_t ts, uint64_t period,
+		       uint64_t start);
+
+/* CLOCK_MONOTONIC, in nanoseconds */
+uint64_t stats_now(void);
+
+#endif
@@ -21,18 +21,18 @@
  * SOFTWARE.
  */
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include <drm_fourcc.h>
+
+#include "kms.h"
 #include "utils.h"
 
 #define ARRAY_SIZE(a) ((int)(sizeof(a)/sizeof((a)[0])))
 
-static uint32_t planes_used;
-static uint32_t crtcs_used;
-static uint32_t encoders_used;
-static uint32_t connectors_used;
-
 static const char *connector_type_str[] = {
 	[DRM_MODE_CONNECTOR_Unknown]     = "Unknown",
 	[DRM_MODE_CONNECTOR_VGA]         = "VGA",
@@ -49,7 +49,7 @@ static const char *connector_type_str[] = {
 	[DRM_MODE_CONNECTOR_HDMIB]       = "HDMI-B",
 	[DRM_MODE_CONNECTOR_TV]          = "TV",
 	[DRM_MODE_CONNECTOR_eDP]         = "eDP",
-//	[DRM_MODE_CONNECTOR_VIRTUAL]     = "Virtual",
+	[DRM_MODE_CONNECTOR_VIRTUAL]     = "Virtual",
 };
 
 static const char *encoder_type_str[] = {
@@ -58,6 +58,7 @@ static const char *encoder_type_str[] = {
 	[DRM_MODE_ENCODER_TMDS]  = "TMDS",
 	[DRM_MODE_ENCODER_LVDS]  = "LVDS",
 	[DRM_MODE_ENCODER_TVDAC] = "TVDAC",
+	[DRM_MODE_ENCODER_VIRTUAL] = "Virtual",
 };
 
 void print_mode(const char *title, const drmModeModeInfo *mode)
@@ -91,378 +92,715 @@ void print_mode(const char *title, const drmModeModeInfo *mode)
 	       mode->flags);
 }
 
-static int get_encoder_idx(drmModeResPtr res, drmModeEncoderPtr encoder)
+/* same timings, whatever the modes are called */
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+		a->hdisplay == b->hdisplay &&
+		a->hsync_start == b->hsync_start &&
+		a->hsync_end == b->hsync_end &&
+		a->htotal == b->htotal &&
+		a->hskew == b->hskew &&
+		a->vdisplay == b->vdisplay &&
+		a->vsync_start == b->vsync_start &&
+		a->vsync_end == b->vsync_end &&
+		a->vtotal == b->vtotal &&
+		a->vscan == b->vscan &&
+		a->flags == b->flags;
+}
+
+/* possible_crtcs and friends can only name the first 32 objects */
+static bool has_bit(uint32_t mask, int bit)
+{
+	return bit >= 0 && bit < 32 && (mask & (1u << bit));
+}
+
+static int find_idx(const uint32_t *ids, int count, uint32_t id)
 {
 	int i;
 
-	for (i = 0; i < res->count_encoders; i++) {
-		if (res->encoders[i] == encoder->encoder_id)
+	for (i = 0; i < count; i++) {
+		if (ids[i] == id)
 			return i;
 	}
 
 	return -1;
 }
 
-static int get_crtc_idx(drmModeResPtr res, drmModeCrtcPtr crtc)
+static void connector_name(drmModeConnectorPtr connector, char *name, size_t size)
+{
+	unsigned int type = connector->connector_type;
+
+	if (type >= ARRAY_SIZE(connector_type_str))
+		type = 0;
+
+	snprintf(name, size, "%s-%d", connector_type_str[type],
+		 connector->connector_type_id);
+}
+
+static const char *encoder_name(drmModeEncoderPtr encoder)
+{
+	unsigned int type = encoder->encoder_type;
+
+	if (type >= ARRAY_SIZE(encoder_type_str))
+		type = 0;
+
+	return encoder_type_str[type];
+}
+
+static drmModePropertyPtr find_prop(struct ctx *ctx, uint32_t prop_id)
 {
 	int i;
 
-	for (i = 0; i < res->count_crtcs; i++) {
-		if (res->crtcs[i] == crtc->crtc_id)
-			return i;
+	for (i = 0; i < ctx->count_props; i++) {
+		if (ctx->props[i]->prop_id == prop_id)
+			return ctx->props[i];
 	}
 
-	return -1;
+	return NULL;
 }
 
-bool pick_connector(struct crtc *c, const char *name)
+/*
+ * Reads the properties of one object, fetching the definition of any
+ * property not seen on an earlier object.
+ */
+static bool snapshot_props(struct ctx *ctx, struct obj_props *op,
+			   uint32_t obj_id, uint32_t obj_type)
 {
-	int fd = c->ctx->fd;
-	drmModeResPtr res = c->ctx->res;
-	int i;
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
 
-	if (!res || !c || !name || c->connector_id)
+	props = kms->get_properties(ctx->fd, obj_id, obj_type);
+	if (!props)
 		return false;
 
-	for (i = 0; i < res->count_connectors; i++) {
-		drmModeConnectorPtr connector;
-		char connector_name[32];
-		unsigned int type;
+	op->props = props;
+	op->info = calloc(props->count_props, sizeof *op->info);
+	if (props->count_props && !op->info)
+		return false;
 
-		if (connectors_used & (1 << i))
-			continue;
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = find_prop(ctx, props->props[i]);
+
+		if (!prop) {
+			drmModePropertyPtr *tmp;
+
+			prop = kms->get_property(ctx->fd, props->props[i]);
+			if (!prop)
+				return false;
+
+			tmp = realloc(ctx->props, (ctx->count_props + 1) * sizeof *tmp);
+			if (!tmp) {
+				drmModeFreeProperty(prop);
+				return false;
+			}
+			ctx->props = tmp;
+			ctx->props[ctx->count_props++] = prop;
+		}
 
-		connector = drmModeGetConnector(fd, res->connectors[i]);
-		if (!connector)
-			continue;
+		op->info[i] = prop;
+	}
 
-		type = connector->connector_type;
-		if (type >= ARRAY_SIZE(connector_type_str))
-			type = 0;
+	return true;
+}
 
-		snprintf(connector_name, sizeof connector_name, "%s-%d",
-			 connector_type_str[type],
-			 connector->connector_type_id);
+static void free_props(struct obj_props *op)
+{
+	drmModeFreeObjectProperties(op->props);
+	free(op->info);
+	op->props = NULL;
+	op->info = NULL;
+}
 
-		if (!strcmp(name, connector_name)) {
-			printf("picked connector [%u] id = %u, name = \"%s\"\n",
-			       i, connector->connector_id, connector_name);
-			c->connector_id = connector->connector_id;
-			c->connector_idx = i;
-			connectors_used = 1 << i;
-		}
+const struct obj_props *get_obj_props(struct ctx *ctx, uint32_t obj_id, uint32_t obj_type)
+{
+	int idx;
+
+	switch (obj_type) {
+	case DRM_MODE_OBJECT_CONNECTOR:
+		idx = find_idx(ctx->res->connectors, ctx->res->count_connectors, obj_id);
+		return idx < 0 ? NULL : &ctx->connector_props[idx];
+	case DRM_MODE_OBJECT_CRTC:
+		idx = find_idx(ctx->res->crtcs, ctx->res->count_crtcs, obj_id);
+		return idx < 0 ? NULL : &ctx->crtc_props[idx];
+	case DRM_MODE_OBJECT_PLANE:
+		idx = find_idx(ctx->plane_res->planes, ctx->plane_res->count_planes, obj_id);
+		return idx < 0 ? NULL : &ctx->plane_props[idx];
+	default:
+		return NULL;
+	}
+}
+
+bool get_prop_value(const struct obj_props *op, const char *name, uint64_t *value)
+{
+	uint32_t i;
 
-		drmModeFreeConnector(connector);
+	if (!op)
+		return false;
 
-		if (c->connector_id)
-			return true;
+	for (i = 0; i < op->props->count_props; i++) {
+		if (strcmp(op->info[i]->name, name))
+			continue;
+
+		*value = op->props->prop_values[i];
+		return true;
 	}
 
 	return false;
 }
 
-static bool encoder_has_free_crtc(drmModeResPtr res, drmModeEncoderPtr encoder)
+static drmModePropertyPtr get_prop_info(const struct obj_props *op, const char *name)
+{
+	uint32_t i;
+
+	for (i = 0; i < op->props->count_props; i++) {
+		if (!strcmp(op->info[i]->name, name))
+			return op->info[i];
+	}
+
+	return NULL;
+}
+
+/* DRM_FORMAT_MOD_INVALID as the modifier matches any modifier */
+bool plane_has_format(const struct plane_caps *caps, uint32_t format, uint64_t modifier)
 {
 	int i;
 
-	for (i = 0; i < res->count_crtcs; i++) {
-		if ((encoder->possible_crtcs & (1 << i)) && !(crtcs_used & (1 << i)))
+	for (i = 0; i < caps->count_formats; i++) {
+		if (caps->formats[i].format != format)
+			continue;
+		if (modifier == DRM_FORMAT_MOD_INVALID ||
+		    caps->formats[i].modifier == DRM_FORMAT_MOD_INVALID ||
+		    caps->formats[i].modifier == modifier)
 			return true;
 	}
 
 	return false;
 }
 
-static bool reuse_old_encoder(int fd, drmModeResPtr res, struct crtc *c)
+static bool add_plane_format(struct plane_caps *caps, uint32_t format, uint64_t modifier)
 {
-	drmModeConnectorPtr connector;
-	drmModeEncoderPtr encoder;
-	int encoder_idx;
-	unsigned int type;
+	struct plane_format *tmp;
 
-	connector = drmModeGetConnector(fd, c->connector_id);
-	if (!connector)
+	tmp = realloc(caps->formats, (caps->count_formats + 1) * sizeof *tmp);
+	if (!tmp)
 		return false;
 
-	if (!connector->encoder_id) {
-		drmModeFreeConnector(connector);
-		return false;
-	}
+	caps->formats = tmp;
+	caps->formats[caps->count_formats].format = format;
+	caps->formats[caps->count_formats].modifier = modifier;
+	caps->count_formats++;
+
+	return true;
+}
 
-	encoder = drmModeGetEncoder(fd, connector->encoder_id);
-	if (!encoder) {
-		drmModeFreeConnector(connector);
+/*
+ * IN_FORMATS lists every format with each modifier it can be used
+ * with, as a bitmask over the format list per modifier.
+ */
+static bool parse_in_formats(struct ctx *ctx, struct plane_caps *caps, uint32_t blob_id)
+{
+	const struct drm_format_modifier_blob *hdr;
+	const struct drm_format_modifier *mods;
+	const uint32_t *formats;
+	drmModePropertyBlobPtr blob;
+	bool ok = true;
+	uint32_t i, j;
+
+	blob = kms->get_property_blob(ctx->fd, blob_id);
+	if (!blob)
 		return false;
-	}
 
-	drmModeFreeConnector(connector);
+	hdr = blob->data;
+	formats = (const uint32_t *) ((const char *) hdr + hdr->formats_offset);
+	mods = (const struct drm_format_modifier *) ((const char *) hdr + hdr->modifiers_offset);
 
-	encoder_idx = get_encoder_idx(res, encoder);
+	for (i = 0; ok && i < hdr->count_modifiers; i++) {
+		for (j = 0; ok && j < 64; j++) {
+			if (!(mods[i].formats & (1ULL << j)) ||
+			    mods[i].offset + j >= hdr->count_formats)
+				continue;
 
-	if (encoders_used & (1 << encoder_idx)) {
-		drmModeFreeEncoder(encoder);
-		return false;
+			ok = add_plane_format(caps, formats[mods[i].offset + j],
+					      mods[i].modifier);
+		}
 	}
 
-	if (!encoder_has_free_crtc(res, encoder)) {
-		drmModeFreeEncoder(encoder);
-		return false;
-	}
+	drmModeFreePropertyBlob(blob);
 
-	type = encoder->encoder_type;
-	if (type >= ARRAY_SIZE(encoder_type_str))
-		type = 0;
+	return ok;
+}
 
-	printf("picked encoder [%u] id = %u, type = \"%s\"\n",
-	       encoder_idx, encoder->encoder_id, encoder_type_str[type]);
+static bool snapshot_plane_caps(struct ctx *ctx, int idx)
+{
+	struct plane_caps *caps = &ctx->plane_caps[idx];
+	const struct obj_props *op = &ctx->plane_props[idx];
+	drmModePlanePtr plane = ctx->planes[idx];
+	drmModePropertyPtr zpos;
+	uint64_t blob_id;
+	uint32_t i;
 
-	c->encoder_id = encoder->encoder_id;
-	c->encoder_idx = encoder_idx;
-	encoders_used = 1 << encoder_idx;
+	if (!get_prop_value(op, "IN_FORMATS", &blob_id) ||
+	    !parse_in_formats(ctx, caps, blob_id)) {
+		free(caps->formats);
+		caps->formats = NULL;
+		caps->count_formats = 0;
 
-	drmModeFreeEncoder(encoder);
+		for (i = 0; i < plane->count_formats; i++) {
+			if (!add_plane_format(caps, plane->formats[i], DRM_FORMAT_MOD_INVALID))
+				return false;
+		}
+	}
+
+	zpos = get_prop_info(op, "zpos");
+	if (zpos && zpos->count_values >= 2) {
+		caps->has_zpos = true;
+		caps->zpos_immutable = zpos->flags & DRM_MODE_PROP_IMMUTABLE;
+		caps->zpos_min = zpos->values[0];
+		caps->zpos_max = zpos->values[1];
+	}
 
 	return true;
 }
 
-bool pick_encoder(struct crtc *c)
+/*
+ * Bipartite matching (Kuhn's augmenting paths) between requested
+ * outputs on the left and some KMS object on the right.
+ */
+struct matcher {
+	struct ctx *ctx;
+	const struct output *outputs;
+	int count_left;
+	int count_right;
+	bool (*edge)(struct matcher *m, int l, int r);
+	int *map;	/* left node to output, when several belong to one */
+	int *prefer;
+	int *left;
+	int *right;
+	bool *seen;
+};
+
+static bool augment(struct matcher *m, int l)
 {
-	int fd = c->ctx->fd;
-	drmModeResPtr res = c->ctx->res;
-	drmModeConnectorPtr connector;
-	int i;
+	int pass, i;
+
+	/*
+	 * The preferred match goes first, then everything in order.  Free
+	 * objects are tried before taking one away from another output,
+	 * so earlier picks only move when they have to.
+	 */
+	for (pass = 0; pass < 2; pass++) {
+		for (i = -1; i < m->count_right; i++) {
+			int r = i < 0 ? m->prefer[l] : i;
+
+			if (r < 0 || (i >= 0 && r == m->prefer[l]))
+				continue;
+			if (m->seen[r] || (!pass && m->right[r] >= 0))
+				continue;
+			if (!m->edge(m, l, r))
+				continue;
+
+			m->seen[r] = true;
+
+			if (m->right[r] < 0 || augment(m, m->right[r])) {
+				m->left[l] = r;
+				m->right[r] = l;
+				return true;
+			}
+		}
+	}
 
-	if (!c->connector_id)
-		return false;
+	return false;
+}
 
-	if (reuse_old_encoder(fd, res, c))
-		return true;
+static int match(struct matcher *m)
+{
+	int l, matched = 0;
 
-	connector = drmModeGetConnector(fd, c->connector_id);
-	if (!connector)
-		return false;
+	for (l = 0; l < m->count_left; l++)
+		m->left[l] = -1;
+	for (l = 0; l < m->count_right; l++)
+		m->right[l] = -1;
 
-	for (i = 0; i < connector->count_encoders; i++) {
-		drmModeEncoderPtr encoder;
-		int encoder_idx;
-		unsigned int type;
+	for (l = 0; l < m->count_left; l++) {
+		memset(m->seen, 0, m->count_right * sizeof *m->seen);
+		if (augment(m, l))
+			matched++;
+	}
 
-		encoder = drmModeGetEncoder(fd, connector->encoders[i]);
-		if (!encoder)
-			continue;
+	return matched;
+}
 
-		encoder_idx = get_encoder_idx(res, encoder);
+static bool connector_has_mode(drmModeConnectorPtr connector, const char *mode)
+{
+	int i;
 
-		if (encoders_used & (1 << encoder_idx)) {
-			drmModeFreeEncoder(encoder);
-			continue;
-		}
+	for (i = 0; i < connector->count_modes; i++) {
+		if (!strcmp(connector->modes[i].name, mode))
+			return true;
+	}
 
-		if (!encoder_has_free_crtc(res, encoder)) {
-			drmModeFreeEncoder(encoder);
-			continue;
-		}
+	return false;
+}
 
-		type = encoder->encoder_type;
-		if (type >= ARRAY_SIZE(encoder_type_str))
-			type = 0;
+static const struct output *left_output(struct matcher *m, int l)
+{
+	return &m->outputs[m->map ? m->map[l] : l];
+}
 
-		printf("picked encoder [%u] id = %u, type = \"%s\"\n",
-		       encoder_idx, encoder->encoder_id, encoder_type_str[type]);
+static bool plane_edge(struct matcher *m, int l, int r, uint32_t type)
+{
+	struct ctx *ctx = m->ctx;
+	const struct output *o = left_output(m, l);
 
-		c->encoder_id = encoder->encoder_id;
-		c->encoder_idx = encoder_idx;
-		encoders_used = 1 << encoder_idx;
+	if (ctx->planes_used[r])
+		return false;
 
-		drmModeFreeEncoder(encoder);
+	return ctx->plane_types[r] == type &&
+		has_bit(ctx->planes[r]->possible_crtcs, o->crtc->crtc_idx);
+}
 
-		break;
-	}
+static bool primary_edge(struct matcher *m, int l, int r)
+{
+	return plane_edge(m, l, r, DRM_PLANE_TYPE_PRIMARY);
+}
+
+static bool overlay_edge(struct matcher *m, int l, int r)
+{
+	const struct output *o = left_output(m, l);
 
-	drmModeFreeConnector(connector);
+	if (o->overlay_format &&
+	    !plane_has_format(&m->ctx->plane_caps[r], o->overlay_format,
+			      DRM_FORMAT_MOD_INVALID))
+		return false;
 
-	return c->encoder_id != 0;
+	return plane_edge(m, l, r, DRM_PLANE_TYPE_OVERLAY);
 }
 
-static bool reuse_old_crtc(int fd, drmModeResPtr res, struct crtc *c)
+/*
+ * Encoders are as exclusive as CRTCs, and the encoder decides which
+ * CRTCs a connector can have, so the two get picked together: a plain
+ * search over (encoder, CRTC) pairs, from output i on.  Whatever the
+ * connector is lit by now goes first.  There are only ever a handful
+ * of each, and what's returned can always be set up.
+ */
+static bool pick_crtcs(struct ctx *ctx, struct output *outputs, int count, int i)
 {
-	drmModeEncoderPtr encoder;
-	drmModeCrtcPtr crtc;
-	int crtc_idx;
+	struct crtc *c;
+	drmModeConnectorPtr connector;
+	int j, k;
 
-	encoder = drmModeGetEncoder(fd, c->encoder_id);
-	if (!encoder)
-		return false;
+	if (i == count)
+		return true;
 
-	if (!encoder->crtc_id) {
-		drmModeFreeEncoder(encoder);
-		return false;
-	}
+	c = outputs[i].crtc;
+	connector = ctx->connectors[c->connector_idx];
 
-	crtc = drmModeGetCrtc(fd, encoder->crtc_id);
-	if (!crtc) {
-		drmModeFreeEncoder(encoder);
-		return false;
-	}
+	for (j = -1; j < connector->count_encoders; j++) {
+		uint32_t id = j < 0 ? connector->encoder_id : connector->encoders[j];
+		int e = find_idx(ctx->res->encoders, ctx->res->count_encoders, id);
+		int prefer;
+
+		if (e < 0 || ctx->encoders_used[e] ||
+		    (j >= 0 && id == connector->encoder_id))
+			continue;
 
-	drmModeFreeEncoder(encoder);
+		prefer = find_idx(ctx->res->crtcs, ctx->res->count_crtcs,
+				  ctx->encoders[e]->crtc_id);
 
-	crtc_idx = get_crtc_idx(res, crtc);
+		for (k = -1; k < ctx->res->count_crtcs; k++) {
+			int r = k < 0 ? prefer : k;
 
-	if (crtcs_used & (1 << crtc_idx)) {
-		drmModeFreeCrtc(crtc);
-		return false;
+			if (r < 0 || (k >= 0 && r == prefer))
+				continue;
+			if (ctx->crtcs_used[r] ||
+			    !has_bit(ctx->encoders[e]->possible_crtcs, r))
+				continue;
+
+			ctx->encoders_used[e] = true;
+			ctx->crtcs_used[r] = true;
+			c->encoder_idx = e;
+			c->crtc_idx = r;
+
+			if (pick_crtcs(ctx, outputs, count, i + 1))
+				return true;
+
+			ctx->encoders_used[e] = false;
+			ctx->crtcs_used[r] = false;
+		}
 	}
 
-	printf("picked crtc [%u] id = %u\n", crtc_idx, crtc->crtc_id);
+	return false;
+}
 
-	c->crtc_id = crtc->crtc_id;
-	c->crtc_idx = crtc_idx;
-	crtcs_used = 1 << crtc_idx;
+struct probe {
+	struct ctx *ctx;
+	int idx;
+	drmModeConnectorPtr connector;
+	pthread_t thread;
+	bool threaded;
+};
 
-	drmModeFreeCrtc(crtc);
+static void *probe_thread(void *data)
+{
+	struct probe *p = data;
 
-	return true;
+	p->connector = kms->get_connector(p->ctx->fd, p->ctx->res->connectors[p->idx]);
+
+	return NULL;
 }
 
-bool pick_crtc(struct crtc *c)
+/*
+ * A full probe can take a good fraction of a second on DP/HDMI (EDID,
+ * link training), so the connectors are probed side by side rather
+ * than one after the other.
+ */
+static void probe_connectors(struct ctx *ctx, const int *idx, int count)
 {
-	int fd = c->ctx->fd;
-	drmModeResPtr res = c->ctx->res;
-	drmModeEncoderPtr encoder;
+	struct obj_props props;
+	struct probe *probes;
 	int i;
 
-	if (!c->encoder_id)
-		return false;
+	if (!count)
+		return;
 
-	if (reuse_old_crtc(fd, res, c))
-		return true;
+	probes = calloc(count, sizeof *probes);
+	if (!probes)
+		return;
 
-	encoder = drmModeGetEncoder(fd, c->encoder_id);
-	if (!encoder)
-		return false;
+	for (i = 0; i < count; i++) {
+		probes[i].ctx = ctx;
+		probes[i].idx = idx[i];
 
-	for (i = 0; i < res->count_crtcs; i++) {
-		drmModeCrtcPtr crtc;
+		/* no point in a thread for the last one */
+		if (i + 1 < count)
+			probes[i].threaded = !pthread_create(&probes[i].thread, NULL,
+							     probe_thread, &probes[i]);
+		if (!probes[i].threaded)
+			probe_thread(&probes[i]);
+	}
 
-		crtc = drmModeGetCrtc(fd, res->crtcs[i]);
-		if (!crtc)
-			continue;
+	for (i = 0; i < count; i++) {
+		if (probes[i].threaded)
+			pthread_join(probes[i].thread, NULL);
 
-		if (crtcs_used & (1 << i)) {
-			drmModeFreeCrtc(crtc);
+		if (!probes[i].connector)
 			continue;
-		}
 
-		if (!(encoder->possible_crtcs & (1 << i))) {
-			drmModeFreeEncoder(encoder);
-			continue;
+		drmModeFreeConnector(ctx->connectors[probes[i].idx]);
+		ctx->connectors[probes[i].idx] = probes[i].connector;
+
+		/*
+		 * A probe can change properties too (vrr_capable comes
+		 * from the EDID).  Not from the threads: it may add to
+		 * ctx->props.  The old ones stay if this fails.
+		 */
+		memset(&props, 0, sizeof props);
+		if (snapshot_props(ctx, &props, probes[i].connector->connector_id,
+				   DRM_MODE_OBJECT_CONNECTOR)) {
+			free_props(&ctx->connector_props[probes[i].idx]);
+			ctx->connector_props[probes[i].idx] = props;
+		} else {
+			free_props(&props);
 		}
+	}
 
-		printf("picked crtc [%u] id = %u\n", i, crtc->crtc_id);
+	free(probes);
+}
 
-		c->crtc_id = crtc->crtc_id;
-		c->crtc_idx = i;
-		crtcs_used |= 1 << i;
+bool pick_outputs(struct ctx *ctx, struct output *outputs, int count)
+{
+	int max = ctx->res->count_crtcs;
+	struct matcher m = {
+		.ctx = ctx,
+		.outputs = outputs,
+		.count_left = count,
+	};
+	bool ok = false;
+	int *probe, *slots = NULL;
+	int count_probe = 0;
+	int count_slots = 0, max_overlays = 0;
+	int i, j, k;
+
+	if (ctx->plane_res->count_planes > max)
+		max = ctx->plane_res->count_planes;
+
+	for (i = 0; i < count; i++) {
+		count_slots += outputs[i].count_overlays;
+		if (outputs[i].count_overlays > max_overlays)
+			max_overlays = outputs[i].count_overlays;
+	}
 
-		drmModeFreeCrtc(crtc);
+	m.prefer = calloc(count + count_slots, sizeof *m.prefer);
+	m.left = calloc(count + count_slots, sizeof *m.left);
+	m.right = calloc(max, sizeof *m.right);
+	m.seen = calloc(max, sizeof *m.seen);
+	probe = calloc(count, sizeof *probe);
+	if (count_slots)
+		slots = calloc(count_slots, sizeof *slots);
+	if (!m.prefer || !m.left || !m.right || !m.seen || !probe ||
+	    (count_slots && !slots))
+		goto out;
+
+	/* connectors first, by name */
+	for (i = 0; i < count; i++) {
+		struct crtc *c = outputs[i].crtc;
+		drmModeConnectorPtr connector;
+		char name[32];
 
-		break;
-	}
+		for (j = 0; j < ctx->res->count_connectors; j++) {
+			if (ctx->connectors_used[j])
+				continue;
 
-	drmModeFreeEncoder(encoder);
+			connector_name(ctx->connectors[j], name, sizeof name);
+			if (!strcmp(name, outputs[i].name))
+				break;
+		}
 
-	return c->crtc_id != 0;
-}
+		if (j == ctx->res->count_connectors) {
+			printf("no free connector \"%s\"\n", outputs[i].name);
+			goto out;
+		}
 
+		printf("picked connector [%u] id = %u, name = \"%s\"\n",
+		       j, ctx->connectors[j]->connector_id, outputs[i].name);
+
+		c->connector_id = ctx->connectors[j]->connector_id;
+		c->connector_idx = j;
+		ctx->connectors_used[j] = true;
+
+		/*
+		 * The snapshot didn't probe anything; only go to the hardware
+		 * if what the kernel last saw isn't good enough.
+		 */
+		connector = ctx->connectors[j];
+		if (connector->connection != DRM_MODE_CONNECTED ||
+		    (outputs[i].mode && !connector_has_mode(connector, outputs[i].mode)))
+			probe[count_probe++] = j;
+	}
 
-static bool check_plane(int fd, drmModePlanePtr plane, int crtc_idx, int primary)
-{
-	drmModeObjectPropertiesPtr props;
-	bool ok = false;
-	uint32_t i;
+	probe_connectors(ctx, probe, count_probe);
 
-	if ((crtc_idx >= 0) && !(plane->possible_crtcs & (1 << crtc_idx)))
-		return false;
+	/* and whether they can do the mode at all */
+	for (i = 0; i < count; i++) {
+		struct crtc *c = outputs[i].crtc;
 
-	props = drmModeObjectGetProperties(fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
-	if (!props)
-		return false;
+		if (outputs[i].mode &&
+		    !connector_has_mode(ctx->connectors[c->connector_idx], outputs[i].mode)) {
+			printf("connector \"%s\" has no mode \"%s\"\n",
+			       outputs[i].name, outputs[i].mode);
+			goto out;
+		}
+	}
 
-	for (i = 0; i < props->count_props; i++) {
-		drmModePropertyPtr prop;
+	if (!pick_crtcs(ctx, outputs, count, 0)) {
+		printf("can't find an encoder and crtc for every connector\n");
+		goto out;
+	}
 
-		prop = drmModeGetProperty(fd, props->props[i]);
-		if (!prop)
-			continue;
+	for (i = 0; i < count; i++) {
+		struct crtc *c = outputs[i].crtc;
+
+		c->crtc_id = ctx->res->crtcs[c->crtc_idx];
+		c->encoder_id = ctx->res->encoders[c->encoder_idx];
 
-		printf("plane prop %s %u\n", prop->name, prop->prop_id);
+		printf("picked encoder [%u] id = %u, type = \"%s\"\n",
+		       c->encoder_idx, c->encoder_id, encoder_name(ctx->encoders[c->encoder_idx]));
+		printf("picked crtc [%u] id = %u\n", c->crtc_idx, c->crtc_id);
+	}
 
-		if (!strcmp(prop->name, "type")) {
-			uint32_t type = props->prop_values[i];
-			if (primary)
-				ok = (type == DRM_PLANE_TYPE_PRIMARY);
-			else
-				ok = (type == DRM_PLANE_TYPE_OVERLAY);
+	/* then the planes, on the CRTCs just picked */
+	m.count_right = ctx->plane_res->count_planes;
+	for (i = 0; i < count; i++) {
+		m.prefer[i] = -1;
+		for (j = 0; j < m.count_right; j++) {
+			if (ctx->planes[j]->crtc_id == outputs[i].crtc->crtc_id &&
+			    ctx->plane_types[j] == DRM_PLANE_TYPE_PRIMARY)
+				m.prefer[i] = j;
 		}
+	}
 
-		drmModeFreeProperty(prop);
+	m.edge = primary_edge;
+	if (match(&m) != count) {
+		printf("can't find a primary plane for every crtc\n");
+		goto out;
 	}
 
-	drmModeFreeObjectProperties(props);
+	for (i = 0; i < count; i++) {
+		struct plane *p = outputs[i].primary;
 
-	return ok;
-}
+		p->plane_idx = m.left[i];
+		p->plane_id = ctx->plane_res->planes[p->plane_idx];
+		ctx->planes_used[p->plane_idx] = true;
 
-bool pick_plane(struct plane *p, int crtcid)
-{
-	int fd = p->ctx->fd;
-	drmModeResPtr res = p->ctx->res;
-	drmModePlaneResPtr plane_res = p->ctx->plane_res;
-	drmModeCrtcPtr crtc;
-	int crtc_idx;
-	int i;
+		printf("picked plane [%u] id = %u\n", p->plane_idx, p->plane_id);
+	}
 
-	if (!p->crtc->crtc_id)
-		return false;
+	/*
+	 * One overlay slot per output per round, so the matching fills
+	 * everyone's first overlay before anyone's second.
+	 */
+	for (j = 0, k = 0; j < max_overlays; j++) {
+		for (i = 0; i < count; i++) {
+			if (j < outputs[i].count_overlays)
+				slots[k++] = i;
+		}
+	}
 
-	crtc = drmModeGetCrtc(fd, p->crtc->crtc_id);
-	if (!crtc)
-		return false;
+	for (k = 0; k < count_slots; k++)
+		m.prefer[k] = -1;
 
-	crtc_idx = get_crtc_idx(res, crtc);
+	m.count_left = count_slots;
+	m.map = slots;
+	m.edge = overlay_edge;
+	match(&m);
 
-	for (i = 0; i < plane_res->count_planes; i++) {
-		drmModePlanePtr plane;
+	for (i = 0; i < count; i++) {
+		int n = 0;
 
-		plane = drmModeGetPlane(fd, plane_res->planes[i]);
-		if (!plane)
-			continue;
+		for (k = 0; k < count_slots; k++) {
+			struct plane *p;
 
-		if (!check_plane(fd, plane, crtc_idx, crtcid >= 0)) {
-			drmModeFreePlane(plane);
-			continue;
-		}
+			if (slots[k] != i || m.left[k] < 0)
+				continue;
 
-		if (planes_used & (1 << i)) {
-			drmModeFreePlane(plane);
-			continue;
-		}
+			p = outputs[i].overlays[n++];
+			p->plane_idx = m.left[k];
+			p->plane_id = ctx->plane_res->planes[p->plane_idx];
+			ctx->planes_used[p->plane_idx] = true;
 
-		printf("picked plane [%u] id = %u\n", i, plane->plane_id);
+			printf("picked plane [%u] id = %u\n", p->plane_idx, p->plane_id);
+		}
 
-		p->plane_id = plane->plane_id;
-		p->plane_idx = i;
-		planes_used = 1 << i;
+		if (n < outputs[i].count_overlays)
+			printf("only %d of %d overlay planes for connector \"%s\"\n",
+			       n, outputs[i].count_overlays, outputs[i].name);
 
-		drmModeFreePlane(plane);
+		outputs[i].count_overlays = n;
+	}
 
-		break;
+	ok = true;
+
+out:
+	if (!ok) {
+		for (i = 0; i < count; i++) {
+			for (j = 0; j < outputs[i].count_overlays; j++)
+				release_plane(outputs[i].overlays[j]);
+			release_plane(outputs[i].primary);
+			release_crtc(outputs[i].crtc);
+			release_encoder(outputs[i].crtc);
+			release_connector(outputs[i].crtc);
+		}
 	}
 
-	drmModeFreeCrtc(crtc);
+	free(m.prefer);
+	free(m.left);
+	free(m.right);
+	free(m.seen);
+	free(probe);
+	free(slots);
 
-	return p->plane_id != 0;
+	return ok;
 }
 
 void release_connector(struct crtc *c)
@@ -470,7 +808,7 @@ void release_connector(struct crtc *c)
 	if (!c->connector_id)
 		return;
 
-	connectors_used &= ~(1 << c->connector_idx);
+	c->ctx->connectors_used[c->connector_idx] = false;
 	c->connector_id = 0;
 	c->connector_idx = 0;
 }
@@ -480,7 +818,7 @@ void release_encoder(struct crtc *c)
 	if (!c->encoder_id)
 		return;
 
-	encoders_used &= ~(1 << c->encoder_idx);
+	c->ctx->encoders_used[c->encoder_idx] = false;
 	c->encoder_id = 0;
 	c->encoder_idx = 0;
 }
@@ -490,7 +828,7 @@ void release_crtc(struct crtc *c)
 	if (!c->crtc_id)
 		return;
 
-	crtcs_used &= ~(1 << c->crtc_idx);
+	c->ctx->crtcs_used[c->crtc_idx] = false;
 	c->crtc_id = 0;
 	c->crtc_idx = 0;
 }
@@ -500,43 +838,161 @@ void release_plane(struct plane *p)
 	if (!p->plane_id)
 		return;
 
-	planes_used &= ~(1 << p->plane_idx);
+	p->ctx->planes_used[p->plane_idx] = false;
 	p->plane_id = 0;
 	p->plane_idx = 0;
 }
 
+/*
+ * Everything about the device that picking outputs and planes needs
+ * is read here, once, so that doesn't cost any more ioctls.
+ */
+static bool snapshot(struct ctx *ctx)
+{
+	drmModeResPtr res = ctx->res;
+	drmModePlaneResPtr plane_res = ctx->plane_res;
+	int fd = ctx->fd;
+	uint32_t i;
+	int j;
+
+	ctx->connectors = calloc(res->count_connectors, sizeof *ctx->connectors);
+	ctx->connector_props = calloc(res->count_connectors, sizeof *ctx->connector_props);
+	ctx->encoders = calloc(res->count_encoders, sizeof *ctx->encoders);
+	ctx->crtcs = calloc(res->count_crtcs, sizeof *ctx->crtcs);
+	ctx->crtc_props = calloc(res->count_crtcs, sizeof *ctx->crtc_props);
+	ctx->planes = calloc(plane_res->count_planes, sizeof *ctx->planes);
+	ctx->plane_props = calloc(plane_res->count_planes, sizeof *ctx->plane_props);
+	ctx->plane_types = calloc(plane_res->count_planes, sizeof *ctx->plane_types);
+	ctx->plane_caps = calloc(plane_res->count_planes, sizeof *ctx->plane_caps);
+	ctx->connectors_used = calloc(res->count_connectors, sizeof *ctx->connectors_used);
+	ctx->encoders_used = calloc(res->count_encoders, sizeof *ctx->encoders_used);
+	ctx->crtcs_used = calloc(res->count_crtcs, sizeof *ctx->crtcs_used);
+	ctx->planes_used = calloc(plane_res->count_planes, sizeof *ctx->planes_used);
+
+	if ((res->count_connectors && (!ctx->connectors || !ctx->connector_props ||
+				       !ctx->connectors_used)) ||
+	    (res->count_encoders && (!ctx->encoders || !ctx->encoders_used)) ||
+	    (res->count_crtcs && (!ctx->crtcs || !ctx->crtc_props || !ctx->crtcs_used)) ||
+	    (plane_res->count_planes && (!ctx->planes || !ctx->plane_props ||
+					 !ctx->plane_types || !ctx->plane_caps ||
+					 !ctx->planes_used)))
+		return false;
+
+	for (j = 0; j < res->count_connectors; j++) {
+		ctx->connectors[j] = kms->get_connector_current(fd, res->connectors[j]);
+		if (!ctx->connectors[j] ||
+		    !snapshot_props(ctx, &ctx->connector_props[j], res->connectors[j],
+				    DRM_MODE_OBJECT_CONNECTOR))
+			return false;
+	}
+
+	for (j = 0; j < res->count_encoders; j++) {
+		ctx->encoders[j] = kms->get_encoder(fd, res->encoders[j]);
+		if (!ctx->encoders[j])
+			return false;
+	}
+
+	for (j = 0; j < res->count_crtcs; j++) {
+		ctx->crtcs[j] = kms->get_crtc(fd, res->crtcs[j]);
+		if (!ctx->crtcs[j] ||
+		    !snapshot_props(ctx, &ctx->crtc_props[j], res->crtcs[j],
+				    DRM_MODE_OBJECT_CRTC))
+			return false;
+	}
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
+		ctx->planes[i] = kms->get_plane(fd, plane_res->planes[i]);
+		if (!ctx->planes[i] ||
+		    !snapshot_props(ctx, &ctx->plane_props[i], plane_res->planes[i],
+				    DRM_MODE_OBJECT_PLANE))
+			return false;
+
+		get_prop_value(&ctx->plane_props[i], "type", &type);
+		ctx->plane_types[i] = type;
+
+		if (!snapshot_plane_caps(ctx, i))
+			return false;
+	}
+
+	return true;
+}
+
 bool init_ctx(struct ctx *ctx, int fd)
 {
 	drmModeResPtr res;
 	drmModePlaneResPtr plane_res;
 
-	res = drmModeGetResources(fd);
+	res = kms->get_resources(fd);
 	if (!res)
 		return false;
 
-	plane_res = drmModeGetPlaneResources(fd);
+	plane_res = kms->get_plane_resources(fd);
         if (!plane_res) {
 		drmModeFreeResources(res);
 		return false;
 	}
 
+	memset(ctx, 0, sizeof *ctx);
 	ctx->fd = fd;
 	ctx->res = res;
 	ctx->plane_res = plane_res;
 
+	if (!snapshot(ctx)) {
+		free_ctx(ctx);
+		return false;
+	}
+
 	return true;
 }
 
 void free_ctx(struct ctx *ctx)
 {
+	uint32_t i;
+	int j;
+
 	if (ctx->fd < 0)
 		return;
 
+	for (j = 0; ctx->connectors && j < ctx->res->count_connectors; j++) {
+		drmModeFreeConnector(ctx->connectors[j]);
+		free_props(&ctx->connector_props[j]);
+	}
+	for (j = 0; ctx->encoders && j < ctx->res->count_encoders; j++)
+		drmModeFreeEncoder(ctx->encoders[j]);
+	for (j = 0; ctx->crtcs && j < ctx->res->count_crtcs; j++) {
+		drmModeFreeCrtc(ctx->crtcs[j]);
+		free_props(&ctx->crtc_props[j]);
+	}
+	for (i = 0; ctx->planes && i < ctx->plane_res->count_planes; i++) {
+		drmModeFreePlane(ctx->planes[i]);
+		free_props(&ctx->plane_props[i]);
+		if (ctx->plane_caps)
+			free(ctx->plane_caps[i].formats);
+	}
+	for (j = 0; j < ctx->count_props; j++)
+		drmModeFreeProperty(ctx->props[j]);
+
+	free(ctx->connectors);
+	free(ctx->connector_props);
+	free(ctx->encoders);
+	free(ctx->crtcs);
+	free(ctx->crtc_props);
+	free(ctx->planes);
+	free(ctx->plane_props);
+	free(ctx->plane_types);
+	free(ctx->plane_caps);
+	free(ctx->props);
+	free(ctx->connectors_used);
+	free(ctx->encoders_used);
+	free(ctx->crtcs_used);
+	free(ctx->planes_used);
+
 	drmModeFreePlaneResources(ctx->plane_res);
 	drmModeFreeResources(ctx->res);
 
-	ctx->plane_res = NULL;
-	ctx->res = NULL;
+	memset(ctx, 0, sizeof *ctx);
 	ctx->fd = -1;
 }
 
@@ -555,31 +1011,24 @@ void init_plane(struct plane *p, struct crtc *c, struct ctx *ctx)
 
 bool pick_mode(struct crtc *c, drmModeModeInfoPtr mode, const char *name)
 {
-	int fd = c->ctx->fd;
 	drmModeConnectorPtr connector;
 	int i;
-	bool found = false;
 
 	if (!c->connector_id)
 		return false;
 
-	connector = drmModeGetConnector(fd, c->connector_id);
-	if (!connector)
-		return false;
+	connector = c->ctx->connectors[c->connector_idx];
 
 	for (i = 0; i < connector->count_modes; i++) {
 		if (strcmp(connector->modes[i].name, name))
 			continue;
 
 		*mode = connector->modes[i];
-		found = true;
 
 		print_mode("picked mode", mode);
 
-		break;
+		return true;
 	}
 
-	drmModeFreeConnector(connector);
-
-	return found;
+	return false;
 }
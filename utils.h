@@ -35,10 +35,54 @@
 	(type*)((char*)__ptr - offsetof(type, member));		\
 })
 
+/* an object's properties, with each one's definition alongside */
+struct obj_props {
+	drmModeObjectPropertiesPtr props;
+	drmModePropertyPtr *info;
+};
+
+struct plane_format {
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/* what a plane can do, as far as its properties tell */
+struct plane_caps {
+	/* from IN_FORMATS, or the plain format list with DRM_FORMAT_MOD_INVALID */
+	struct plane_format *formats;
+	int count_formats;
+
+	bool has_zpos;
+	bool zpos_immutable;
+	uint64_t zpos_min;
+	uint64_t zpos_max;
+};
+
 struct ctx {
 	int fd;
 	drmModeResPtr res;
 	drmModePlaneResPtr plane_res;
+
+	/* snapshot of the topology, indexed like res and plane_res */
+	drmModeConnectorPtr *connectors;
+	drmModeEncoderPtr *encoders;
+	drmModeCrtcPtr *crtcs;
+	drmModePlanePtr *planes;
+	uint32_t *plane_types;
+	struct plane_caps *plane_caps;
+	struct obj_props *connector_props;
+	struct obj_props *crtc_props;
+	struct obj_props *plane_props;
+
+	/* every property definition seen, shared by all objects */
+	drmModePropertyPtr *props;
+	int count_props;
+
+	/* which objects are taken, also indexed like res and plane_res */
+	bool *connectors_used;
+	bool *encoders_used;
+	bool *crtcs_used;
+	bool *planes_used;
 };
 
 struct crtc {
@@ -67,17 +111,40 @@ void free_ctx(struct ctx *ctx);
 void init_crtc(struct crtc *c, struct ctx *ctx);
 void init_plane(struct plane *p, struct crtc *c, struct ctx *ctx);
 
-bool pick_connector(struct crtc *c, const char *name);
-bool pick_encoder(struct crtc *c);
-bool pick_crtc(struct crtc *c);
-bool pick_plane(struct plane *p, int crtcid);
+/* what one display needs: a connector by name, in a given mode */
+struct output {
+	const char *name;
+	const char *mode;
+	struct crtc *crtc;
+	struct plane *primary;
+
+	/* as many overlays as wanted, count_overlays says how many it got */
+	struct plane **overlays;
+	int count_overlays;
+	uint32_t overlay_format;	/* or 0 for any */
+};
+
+/*
+ * Finds a connector, encoder, CRTC and primary plane for every output
+ * at once, so an early pick can't starve a later one.  Either all of
+ * them get assigned or none does.  Overlays are handed out a round at a
+ * time, one more per output per round, for as long as there are planes
+ * left that can take the format; running short of them isn't an error.
+ */
+bool pick_outputs(struct ctx *ctx, struct output *outputs, int count);
 
 void release_connector(struct crtc *c);
 void release_encoder(struct crtc *c);
 void release_crtc(struct crtc *c);
 void release_plane(struct plane *p);
 
+const struct obj_props *get_obj_props(struct ctx *ctx, uint32_t obj_id, uint32_t obj_type);
+bool get_prop_value(const struct obj_props *op, const char *name, uint64_t *value);
+
+bool plane_has_format(const struct plane_caps *caps, uint32_t format, uint64_t modifier);
+
 void print_mode(const char *title, const drmModeModeInfo *mode);
+bool mode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b);
 bool pick_mode(struct crtc *c, drmModeModeInfoPtr mode, const char *name);
 
 #endif
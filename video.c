@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
+
+#include <drm_fourcc.h>
+
+#include "video.h"
+
+/* BT.601 Cb/Cr of the usual eight colour bars */
+static const uint8_t bars[8][2] = {
+	{ 128, 128 },	/* white */
+	{  16, 146 },	/* yellow */
+	{ 166,  16 },	/* cyan */
+	{  54,  34 },	/* green */
+	{ 202, 222 },	/* magenta */
+	{  90, 240 },	/* red */
+	{ 240, 110 },	/* blue */
+	{ 128, 128 },	/* black */
+};
+
+static void fill_luma(uint8_t *dst, unsigned int stride,
+		      unsigned int width, unsigned int height,
+		      unsigned int frame)
+{
+	unsigned int y;
+
+	/* video range, 16 to 235 */
+	for (y = 0; y < height; y++)
+		memset(dst + y * stride, 16 + ((y + frame) & 0xff) * 219 / 256, width);
+}
+
+/* the first row of a plane, repeated all the way down */
+static void copy_rows(uint8_t *dst, unsigned int stride,
+		      unsigned int bytes, unsigned int height)
+{
+	unsigned int y;
+
+	for (y = 1; y < height; y++)
+		memcpy(dst + y * stride, dst, bytes);
+}
+
+/* step bytes between samples of the same component */
+static void fill_bars(uint8_t *dst, unsigned int width,
+		      unsigned int step, unsigned int comp)
+{
+	unsigned int x;
+
+	for (x = 0; x < width; x++)
+		dst[x * step] = bars[x * 8 / width][comp];
+}
+
+void video_fill(const struct surface *s, struct buffer *b, unsigned int frame)
+{
+	uint8_t *map = b->map;
+	unsigned int cw = s->width / 2;
+	unsigned int ch = s->height / 2;
+
+	fill_luma(map + b->offset[0], b->stride[0], s->width, s->height, frame);
+
+	switch (s->fmt) {
+	case DRM_FORMAT_NV12:
+		fill_bars(map + b->offset[1], cw, 2, 0);
+		fill_bars(map + b->offset[1] + 1, cw, 2, 1);
+		copy_rows(map + b->offset[1], b->stride[1], cw * 2, ch);
+		break;
+	case DRM_FORMAT_YUV420:
+		fill_bars(map + b->offset[1], cw, 1, 0);
+		fill_bars(map + b->offset[2], cw, 1, 1);
+		copy_rows(map + b->offset[1], b->stride[1], cw, ch);
+		copy_rows(map + b->offset[2], b->stride[2], cw, ch);
+		break;
+	}
+}
+
+static unsigned int plane_row_bytes(const struct format_info *info, int i,
+				    unsigned int width)
+{
+	return width / info->planes[i].hsub * info->planes[i].cpp;
+}
+
+uint64_t video_frame_size(const struct format_info *info,
+			  unsigned int width, unsigned int height)
+{
+	uint64_t size = 0;
+	int i;
+
+	for (i = 0; i < info->count_planes; i++)
+		size += (uint64_t) plane_row_bytes(info, i, width) *
+			(height / info->planes[i].vsub);
+
+	return size;
+}
+
+static bool read_plane(int fd, off_t pos, uint8_t *dst, unsigned int stride,
+		       unsigned int bytes, unsigned int rows)
+{
+	unsigned int y;
+
+	if (stride == bytes)
+		return pread(fd, dst, (size_t) bytes * rows, pos) == (ssize_t) bytes * rows;
+
+	for (y = 0; y < rows; y++) {
+		if (pread(fd, dst + y * stride, bytes, pos + y * bytes) != (ssize_t) bytes)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * The pages are written through the memfd, not the dma-buf, so tell
+ * the exporter: a display that doesn't snoop the CPU's caches needs
+ * them flushed before it scans out.
+ */
+static bool dmabuf_sync(struct buffer *b, uint64_t flags)
+{
+	struct dma_buf_sync sync = {
+		.flags = flags | DMA_BUF_SYNC_WRITE,
+	};
+
+	return !b->udmabuf || !ioctl(b->dmabuf_fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+bool video_read(const struct surface *s, struct buffer *b, int fd,
+		unsigned int frame)
+{
+	const struct format_info *info = s->info;
+	off_t pos = (off_t) frame * video_frame_size(info, s->width, s->height);
+	uint8_t *map = b->map;
+	bool ret = true;
+	int i;
+
+	if (!dmabuf_sync(b, DMA_BUF_SYNC_START))
+		return false;
+
+	for (i = 0; ret && i < info->count_planes; i++) {
+		unsigned int bytes = plane_row_bytes(info, i, s->width);
+		unsigned int rows = s->height / info->planes[i].vsub;
+
+		ret = read_plane(fd, pos, map + b->offset[i], b->stride[i], bytes, rows);
+		pos += (off_t) bytes * rows;
+	}
+
+	/* whatever happened, the START needs its END */
+	if (!dmabuf_sync(b, DMA_BUF_SYNC_END))
+		ret = false;
+
+	return ret;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "gutils.h"
+
+/*
+ * Stand-in for a decoder: writes a moving frame straight into a mapped
+ * YUV buffer with the CPU.  Luma is horizontal bands scrolling with
+ * frame, chroma is still vertical colour bars, so tearing and scaling
+ * artifacts are easy to spot.
+ */
+void video_fill(const struct surface *s, struct buffer *b, unsigned int frame);
+
+/*
+ * Raw video files are just frames one after the other, each plane
+ * tightly packed.  video_read() reads a frame straight into a buffer
+ * the display imported, the copy a decoder would have made anyway.
+ * False if the frame may not have made it whole.
+ */
+uint64_t video_frame_size(const struct format_info *info,
+			  unsigned int width, unsigned int height);
+bool video_read(const struct surface *s, struct buffer *b, int fd,
+		unsigned int frame);
+
+#endif